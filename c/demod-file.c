@@ -0,0 +1,40 @@
+// Demodulate an IQ capture to a WAV or raw PCM file, as fast as possible.
+// Reports the throughput, so it doubles as a benchmark of the decoder.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "nrf.h"
+
+int main(int argc, char **argv) {
+    if (argc < 3 || argc > 5) {
+        fprintf(stderr, "Usage: demod-file IN_FILE.raw OUT_FILE.wav [SAMPLE_RATE] [FREQ_OFFSET]\n");
+        fprintf(stderr, "Writes raw 16-bit PCM if OUT_FILE doesn't end in .wav.\n");
+        exit(EXIT_FAILURE);
+    }
+    const char *in_file = argv[1];
+    const char *out_file = argv[2];
+
+    nrf_decode_file_config config;
+    memset(&config, 0, sizeof(nrf_decode_file_config));
+    config.demodulate_type = NRF_DEMODULATE_WBFM;
+    config.sample_rate = argc > 3 ? atoi(argv[3]) : NRF_DECODE_FILE_DEFAULT_SAMPLE_RATE;
+    config.freq_offset = argc > 4 ? atoi(argv[4]) : 0;
+    size_t out_length = strlen(out_file);
+    if (out_length > 4 && strcmp(out_file + out_length - 4, ".wav") == 0) {
+        config.format = NRF_AUDIO_FORMAT_WAV;
+    } else {
+        config.format = NRF_AUDIO_FORMAT_RAW;
+    }
+
+    nrf_decode_file_stats stats;
+    if (nrf_decode_file(in_file, out_file, config, &stats) != 0) {
+        exit(EXIT_FAILURE);
+    }
+    double capture_seconds = stats.in_samples / (double) config.sample_rate;
+    printf("%llu samples (%.2f s of capture) in %.3f s: %.2f MS/s, %.1fx real time\n",
+        (unsigned long long) stats.in_samples, capture_seconds, stats.seconds, stats.msps,
+        stats.seconds > 0 ? capture_seconds / stats.seconds : 0);
+    return 0;
+}
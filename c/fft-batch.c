@@ -7,13 +7,12 @@
 #include <string.h>
 
 #include <libhackrf/hackrf.h>
-#include <fftw3.h>
 
 #include "easypng.h"
+#include "nrf.h"
 
 const uint32_t FFT_SIZE = 1024;
 const uint32_t FFT_HISTORY_SIZE = 16384;
-const uint32_t SAMPLES_SIZE = 131072;
 const uint64_t FREQUENCY_START = 2e6;
 const uint64_t FREQUENCY_END = 148e6;
 const uint32_t FREQUENCY_STEP = 2e6;
@@ -22,11 +21,12 @@ const uint32_t SAMPLE_BLOCKS_TO_SKIP = 10;
 
 uint64_t frequency = FREQUENCY_START;
 
-fftw_complex *fft_in;
-fftw_complex *fft_out;
-fftw_complex *fft_history;
+nrf_spectrum *spectrum;
+nut_buffer *samples;
+// The magnitude of each bin. Rows are filled from the bottom up, so the
+// newest row ends up on top.
+float *fft_history;
 int history_rows = 0;
-fftw_plan fft_plan;
 hackrf_device *device;
 int skip = SAMPLE_BLOCKS_TO_SKIP;
 
@@ -58,20 +58,11 @@ int receive_sample_block(hackrf_transfer *transfer) {
         return 0;
     }
     if (history_rows >= FFT_HISTORY_SIZE) return 0;
-    int ii = 0;
-    for (int i = 0; i < SAMPLES_SIZE; i += 2) {
-        int vi = (transfer->buffer[i] + 128) % 256;
-        int vq = (transfer->buffer[i + 1] + 128) % 256;
-        fft_in[ii][0] = powf(-1, ii) * vi / 256.0;
-        fft_in[ii][1] = powf(-1, ii) * vq / 256.0;
-        ii++;
+    // HackRF samples are signed; the spectrum expects offset binary.
+    for (int i = 0; i < FFT_SIZE * 2; i++) {
+        samples->data.u8[i] = transfer->buffer[i] ^ 0x80;
     }
-    fftw_execute(fft_plan);
-
-    // Move one line down.
-    memcpy(fft_history + FFT_SIZE, fft_history, FFT_SIZE * (FFT_HISTORY_SIZE - 1) * sizeof(fftw_complex));
-    // Set the first line.
-    memcpy(fft_history, fft_out, FFT_SIZE * sizeof(fftw_complex));
+    nrf_spectrum_process(spectrum, samples, fft_history + (FFT_HISTORY_SIZE - 1 - history_rows) * FFT_SIZE);
 
     history_rows++;
     printf("\r%.f%%", history_rows / (float)FFT_HISTORY_SIZE * 100);
@@ -82,9 +73,8 @@ int receive_sample_block(hackrf_transfer *transfer) {
         uint8_t *buffer = calloc(FFT_SIZE * FFT_HISTORY_SIZE, sizeof(uint8_t));
         for (int y = 0; y < FFT_HISTORY_SIZE; y++) {
             for (int x = 0; x < FFT_SIZE; x++) {
-                double ci = fft_history[y * FFT_SIZE + x][0];
-                double cq = fft_history[y * FFT_SIZE + x][1];
-                double pwr = ci * ci + cq * cq;
+                double magnitude = fft_history[y * FFT_SIZE + x];
+                double pwr = magnitude * magnitude;
                 //double pwr_dbfs = 10.0 * log2(pwr + 1.0e-20) / log2(2.7182818284);
                 double pwr_dbfs = 10.0 * log10(pwr + 1.0e-20);
                 pwr_dbfs = pwr_dbfs * 10;
@@ -135,26 +125,27 @@ static void teardown_hackrf() {
     hackrf_exit();
 }
 
-// FFTW /////////////////////////////////////////////////////////////////////
+// Spectrum /////////////////////////////////////////////////////////////////
 
-static void setup_fftw() {
-    fft_in = (fftw_complex*) fftw_malloc(sizeof(fftw_complex) * SAMPLES_SIZE);
-    fft_out = (fftw_complex*) fftw_malloc(sizeof(fftw_complex) * SAMPLES_SIZE);
-    fft_history = (fftw_complex*) fftw_malloc(sizeof(fftw_complex) * FFT_SIZE * FFT_HISTORY_SIZE);
-    fft_plan = fftw_plan_dft_1d(FFT_SIZE, fft_in, fft_out, FFTW_FORWARD, FFTW_ESTIMATE);
+static void setup_spectrum() {
+    nrf_fft_config config;
+    memset(&config, 0, sizeof(nrf_fft_config));
+    config.fft_size = FFT_SIZE;
+    spectrum = nrf_spectrum_new(config);
+    samples = nut_buffer_new_u8(FFT_SIZE, 2, NULL);
+    fft_history = calloc(FFT_SIZE * FFT_HISTORY_SIZE, sizeof(float));
 }
 
-static void teardown_fftw() {
-    fftw_destroy_plan(fft_plan);
-    fftw_free(fft_in);
-    fftw_free(fft_out);
-    fftw_free(fft_history);
+static void teardown_spectrum() {
+    nrf_spectrum_free(spectrum);
+    nut_buffer_release(samples);
+    free(fft_history);
 }
 
 // Main /////////////////////////////////////////////////////////////////////
 
 int main(int argc, char **argv) {
-    setup_fftw();
+    setup_spectrum();
     setup_hackrf();
     printf("Frequency: %.4f MHz\n", frequency / 1.0e6);
 
@@ -177,7 +168,7 @@ int main(int argc, char **argv) {
     }
 
     teardown_hackrf();
-    teardown_fftw();
+    teardown_spectrum();
 
     return 0;
 }
@@ -2,7 +2,6 @@
 
 #include <GLFW/glfw3.h>
 #include <libhackrf/hackrf.h>
-#include <fftw3.h>
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -10,14 +9,16 @@
 #include <math.h>
 #include <string.h>
 
+#include "nrf.h"
+
 #define WIDTH 1024
 #define HEIGHT 1024
 #define BUFFER_SIZE (WIDTH * HEIGHT)
 #define FFT_SIZE 512
 
-fftw_complex *fft_in;
-fftw_complex *fft_out;
-fftw_plan fft_plan;
+nrf_spectrum *spectrum;
+nut_buffer *samples;
+float fft_line[FFT_SIZE];
 GLfloat fft_real_buffer[FFT_SIZE];
 GLfloat buffer[WIDTH * HEIGHT];
 // byte_to_double_lut[256];
@@ -44,14 +45,11 @@ double intensity_shift = 0.5;
 
 int receive_sample_block(hackrf_transfer *transfer) {
     if (paused) return 0;
-    fftw_complex *p = fft_in;
-    int ii = 0;
-    for (int i = 0; i < 512 * 512; i += 2) {
-        fft_in[ii][0] = transfer->buffer[i] / 255.0;
-        fft_in[ii][1] = transfer->buffer[i + 1] / 255.0;
-        ii++;
+    // HackRF samples are signed; the spectrum expects offset binary.
+    for (int i = 0; i < FFT_SIZE * 2; i++) {
+        samples->data.u8[i] = transfer->buffer[i] ^ 0x80;
     }
-    fftw_execute(fft_plan);
+    nrf_spectrum_process(spectrum, samples, fft_line);
     return 0;
 }
 
@@ -96,18 +94,19 @@ static void set_frequency() {
     HACKRF_CHECK_STATUS(status, "hackrf_set_freq");
 }
 
-// FFTW /////////////////////////////////////////////////////////////////////
+// Spectrum /////////////////////////////////////////////////////////////////
 
-static void setup_fftw() {
-    fft_in = (fftw_complex*) fftw_malloc(sizeof(fftw_complex) * BUFFER_SIZE);
-    fft_out = (fftw_complex*) fftw_malloc(sizeof(fftw_complex) * BUFFER_SIZE);
-    fft_plan = fftw_plan_dft_1d(FFT_SIZE, fft_in, fft_out, FFTW_FORWARD, FFTW_MEASURE);
+static void setup_spectrum() {
+    nrf_fft_config config;
+    memset(&config, 0, sizeof(nrf_fft_config));
+    config.fft_size = FFT_SIZE;
+    spectrum = nrf_spectrum_new(config);
+    samples = nut_buffer_new_u8(FFT_SIZE, 2, NULL);
 }
 
-static void teardown_fftw() {
-    fftw_destroy_plan(fft_plan);
-    fftw_free(fft_in);
-    fftw_free(fft_out);
+static void teardown_spectrum() {
+    nrf_spectrum_free(spectrum);
+    nut_buffer_release(samples);
 }
 
 // OpenGL ///////////////////////////////////////////////////////////////////
@@ -181,19 +180,10 @@ static void prepare() {
 static void update() {
     if (paused) return;
 
+    // The spectrum is already centered on DC.
     for (int i = 0; i < FFT_SIZE; i++) {
-        fftw_complex *pt;
-        if (i < FFT_SIZE / 2) {
-            pt = &fft_out[FFT_SIZE / 2 + i];
-        } else {
-            pt = &fft_out[i - FFT_SIZE / 2];
-        }
-        *pt[0] /= (double) FFT_SIZE;
-        *pt[1] /= (double) FFT_SIZE;
-
-
-        double power = *pt[0] * *pt[0] + *pt[1] * *pt[1];
-        fft_real_buffer[i] = intensity * log10(power + 1.0e-20);
+        double magnitude = fft_line[i] / FFT_SIZE;
+        fft_real_buffer[i] = intensity * log10(magnitude * magnitude + 1.0e-20);
     }
 
     memset(buffer, 0, sizeof(GLfloat) * WIDTH * HEIGHT);
@@ -241,7 +231,7 @@ static void teardown_gl() {
 static void export() {
     FILE *fp = fopen("out.raw", "wb");
     if (fp) {
-        fwrite(fft_out, BUFFER_SIZE, 1, fp);
+        fwrite(fft_line, sizeof(fft_line), 1, fp);
         fclose(fp);
         printf("Written file.\n");
     }
@@ -291,7 +281,7 @@ static void teardown_glfw() {
 
 int main(int argc, char **argv) {
     setup_glfw();
-    setup_fftw();
+    setup_spectrum();
     setup_hackrf();
     setup_gl();
 
@@ -305,7 +295,7 @@ int main(int argc, char **argv) {
 
     teardown_gl();
     teardown_hackrf();
-    teardown_fftw();
+    teardown_spectrum();
     teardown_glfw();
 
     return 0;
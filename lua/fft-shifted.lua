@@ -63,11 +63,11 @@ function on_key(key, mods)
     keys_frequency_handler(key, mods)
     if key == KEY_LEFT_BRACKET then
         shift = shift - 10e3
-        shifter = nrf_freq_shifter_new(shift, device.sample_rate)
+        nrf_freq_shifter_set_freq_offset(shifter, shift)
         print("Shift: " .. shift)
     elseif key == KEY_RIGHT_BRACKET then
         shift = shift + 10e3
-        shifter = nrf_freq_shifter_new(shift, device.sample_rate)
+        nrf_freq_shifter_set_freq_offset(shifter, shift)
         print("Shift: " .. shift)
     end
 end
@@ -72,7 +72,8 @@ function setup()
     filter = nrf_iq_filter_new(device.sample_rate, 200e3, 97)
 
     detector = nrf_signal_detector_new()
-    signal_threshold = 100
+    -- Standard deviation of the raw samples, which range from 0 to 1
+    signal_threshold = 0.14
     state = STATE_DETECTING
     draw_buffer = nil
     have_signal = false
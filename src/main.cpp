@@ -27,8 +27,8 @@ static void l_register_type(lua_State *L, const char *type, lua_CFunction gc_fn)
     if (gc_fn != NULL) {
         lua_pushcfunction(L, gc_fn);
         lua_setfield(L, -2, "__gc");
-        lua_pop(L, 1);
     }
+    lua_pop(L, 1);
 }
 
 static void l_to_table(lua_State *L, const char *type, void *obj) {
@@ -172,9 +172,37 @@ static int l_nut_buffer_save(lua_State *L) {
     return 0;
 }
 
-static int l_nut_buffer_free(lua_State *L) {
+static int l_nut_buffer_get_pool_stats(lua_State *L) {
+    nut_buffer_pool_stats stats = nut_buffer_get_pool_stats();
+    lua_newtable(L);
+
+    lua_pushliteral(L, "hits");
+    lua_pushinteger(L, stats.hits);
+    lua_settable(L, -3);
+
+    lua_pushliteral(L, "misses");
+    lua_pushinteger(L, stats.misses);
+    lua_settable(L, -3);
+
+    lua_pushliteral(L, "bytes_live");
+    lua_pushinteger(L, stats.bytes_live);
+    lua_settable(L, -3);
+
+    lua_pushliteral(L, "bytes_pooled");
+    lua_pushinteger(L, stats.bytes_pooled);
+    lua_settable(L, -3);
+
+    return 1;
+}
+
+static int l_nut_buffer_pool_trim(lua_State *L) {
+    nut_buffer_pool_trim();
+    return 0;
+}
+
+static int l_nut_buffer_release(lua_State *L) {
     nut_buffer *buffer = l_to_nut_buffer(L, 1);
-    nut_buffer_free(buffer);
+    nut_buffer_release(buffer);
     return 0;
 }
 
@@ -630,6 +658,19 @@ static int l_nrf_block_connect(lua_State *L) {
     return 0;
 }
 
+static int l_nrf_block_connect_with_config(lua_State *L) {
+    nrf_block* input = l_to_nrf_block(L, 1);
+    nrf_block* output = l_to_nrf_block(L, 2);
+    nrf_edge_config config;
+    memset(&config, 0, sizeof(nrf_edge_config));
+    if (lua_istable(L, 3)) {
+        config.policy = (nrf_edge_policy) l_table_integer(L, 3, "policy", NRF_EDGE_SYNC);
+        config.queue_length = l_table_integer(L, 3, "queue_length", NRF_EDGE_DEFAULT_QUEUE_LENGTH);
+    }
+    nrf_block_connect_with_config(input, output, config);
+    return 0;
+}
+
 // nrf_device
 
 static nrf_device* l_to_nrf_device(lua_State *L, int index) {
@@ -660,6 +701,8 @@ static int l_nrf_device_new_with_config(lua_State *L) {
         config.sample_rate = l_table_integer(L, 1, "sample_rate", 0);
         config.freq_mhz = l_table_double(L, 1, "freq_mhz", 0);
         config.data_file = l_table_string(L, 1, "data_file", NULL);
+        config.replay_pacing = (nrf_replay_pacing) l_table_integer(L, 1, "replay_pacing", NRF_REPLAY_REALTIME);
+        config.replay_speed = l_table_double(L, 1, "replay_speed", 1);
     }
     nrf_device *device = nrf_device_new_with_config(config);
     return _l_to_nrf_device_table(L, device);
@@ -696,12 +739,60 @@ static int l_nrf_device_step(lua_State *L) {
     return 0;
 }
 
+static int l_nrf_device_seek(lua_State *L) {
+    nrf_device* device = l_to_nrf_device(L, 1);
+    lua_Integer sample_offset = luaL_checkinteger(L, 2);
+    nrf_device_seek(device, sample_offset > 0 ? sample_offset : 0);
+    return 0;
+}
+
+static int l_nrf_device_seek_time(lua_State *L) {
+    nrf_device* device = l_to_nrf_device(L, 1);
+    double seconds = luaL_checknumber(L, 2);
+    nrf_device_seek_time(device, seconds);
+    return 0;
+}
+
 static int l_nrf_device_get_samples_buffer(lua_State *L) {
     nrf_device* device = l_to_nrf_device(L, 1);
     nut_buffer* buffer = nrf_device_get_samples_buffer(device);
     return l_push_nut_buffer(L, buffer);
 }
 
+static int l_nrf_device_next_samples_buffer(lua_State *L) {
+    nrf_device* device = l_to_nrf_device(L, 1);
+    nut_buffer* buffer = nrf_device_next_samples_buffer(device);
+    if (buffer == NULL) {
+        lua_pushnil(L);
+        return 1;
+    }
+    return l_push_nut_buffer(L, buffer);
+}
+
+static int l_nrf_device_get_stats(lua_State *L) {
+    nrf_device* device = l_to_nrf_device(L, 1);
+    nrf_device_stats stats = nrf_device_get_stats(device);
+    lua_newtable(L);
+
+    lua_pushliteral(L, "received");
+    lua_pushinteger(L, stats.received);
+    lua_settable(L, -3);
+
+    lua_pushliteral(L, "overruns");
+    lua_pushinteger(L, stats.overruns);
+    lua_settable(L, -3);
+
+    lua_pushliteral(L, "skipped");
+    lua_pushinteger(L, stats.skipped);
+    lua_settable(L, -3);
+
+    lua_pushliteral(L, "seq");
+    lua_pushinteger(L, stats.seq);
+    lua_settable(L, -3);
+
+    return 1;
+}
+
 static int l_nrf_device_get_iq_buffer(lua_State *L) {
     nrf_device* device = l_to_nrf_device(L, 1);
     nut_buffer* buffer = nrf_device_get_iq_buffer(device);
@@ -770,6 +861,92 @@ static int l_nrf_buffer_to_iq_lines(lua_State *L) {
     return l_push_nut_buffer(L, img);
 }
 
+static int l_nrf_buffer_to_iq_lines_antialiased(lua_State *L) {
+    nut_buffer *buffer = l_to_nut_buffer(L, 1);
+    int size_multiplier = luaL_checkinteger(L, 2);
+    float line_percentage = luaL_checknumber(L, 3);
+    nut_buffer *img = nrf_buffer_to_iq_lines_antialiased(buffer, size_multiplier, line_percentage);
+    return l_push_nut_buffer(L, img);
+}
+
+// nrf_iq_converter
+
+static nrf_iq_converter* l_to_nrf_iq_converter(lua_State *L, int index) {
+    return (nrf_iq_converter*) l_from_table(L, "nrf_iq_converter", index);
+}
+
+static int l_nrf_iq_converter_new(lua_State *L) {
+    int dc_removal = luaL_optinteger(L, 1, 0);
+    int iq_balance = luaL_optinteger(L, 2, 0);
+    nrf_iq_converter *converter = nrf_iq_converter_new(dc_removal, iq_balance);
+    l_to_table(L, "nrf_iq_converter", converter);
+    return 1;
+}
+
+static int l_nrf_iq_converter_process(lua_State *L) {
+    nrf_iq_converter *converter = l_to_nrf_iq_converter(L, 1);
+    nut_buffer *buffer = l_to_nut_buffer(L, 2);
+    nrf_iq_converter_process(converter, buffer);
+    return 0;
+}
+
+static int l_nrf_iq_converter_get_buffer(lua_State *L) {
+    nrf_iq_converter *converter = l_to_nrf_iq_converter(L, 1);
+    nut_buffer *buffer = nrf_iq_converter_get_buffer(converter);
+    return l_push_nut_buffer(L, buffer);
+}
+
+static int l_nrf_iq_converter_free(lua_State *L) {
+    nrf_iq_converter *converter = l_to_nrf_iq_converter(L, 1);
+    nrf_iq_converter_free(converter);
+    return 0;
+}
+
+// nrf_iq_density
+
+static nrf_iq_density* l_to_nrf_iq_density(lua_State *L, int index) {
+    return (nrf_iq_density*) l_from_table(L, "nrf_iq_density", index);
+}
+
+static int l_nrf_iq_density_new(lua_State *L) {
+    nrf_iq_density_config config;
+    memset(&config, 0, sizeof(nrf_iq_density_config));
+    if (lua_istable(L, 1)) {
+        config.resolution = l_table_integer(L, 1, "resolution", NRF_IQ_RESOLUTION);
+        config.decay = l_table_double(L, 1, "decay", NRF_IQ_DENSITY_DEFAULT_DECAY);
+        config.scale = (nrf_iq_density_scale) l_table_integer(L, 1, "scale", NRF_IQ_DENSITY_SATURATE);
+        config.gain = l_table_double(L, 1, "gain", 1);
+    }
+    nrf_iq_density *density = nrf_iq_density_new(config);
+    l_to_table(L, "nrf_iq_density", density);
+    return 1;
+}
+
+static int l_nrf_iq_density_process(lua_State *L) {
+    nrf_iq_density *density = l_to_nrf_iq_density(L, 1);
+    nut_buffer *buffer = l_to_nut_buffer(L, 2);
+    nrf_iq_density_process(density, buffer);
+    return 0;
+}
+
+static int l_nrf_iq_density_clear(lua_State *L) {
+    nrf_iq_density *density = l_to_nrf_iq_density(L, 1);
+    nrf_iq_density_clear(density);
+    return 0;
+}
+
+static int l_nrf_iq_density_get_buffer(lua_State *L) {
+    nrf_iq_density *density = l_to_nrf_iq_density(L, 1);
+    nut_buffer *buffer = nrf_iq_density_get_buffer(density);
+    return l_push_nut_buffer(L, buffer);
+}
+
+static int l_nrf_iq_density_free(lua_State *L) {
+    nrf_iq_density *density = l_to_nrf_iq_density(L, 1);
+    nrf_iq_density_free(density);
+    return 0;
+}
+
 // nrf_fft
 
 static nrf_fft* l_to_nrf_fft(lua_State *L, int index) {
@@ -784,6 +961,24 @@ static int l_nrf_fft_new(lua_State *L) {
     return 1;
 }
 
+static int l_nrf_fft_new_with_config(lua_State *L) {
+    nrf_fft_config config;
+    memset(&config, 0, sizeof(nrf_fft_config));
+    if (lua_istable(L, 1)) {
+        config.fft_size = l_table_integer(L, 1, "fft_size", DEFAULT_FFT_SIZE);
+        config.fft_history_size = l_table_integer(L, 1, "fft_history_size", DEFAULT_FFT_HISTORY_SIZE);
+        config.threads = l_table_integer(L, 1, "threads", 0);
+        config.wisdom_file = l_table_string(L, 1, "wisdom_file", NULL);
+        config.window = (nrf_window_type) l_table_integer(L, 1, "window", NRF_WINDOW_NONE);
+        config.averaging = l_table_integer(L, 1, "averaging", 0);
+        config.overlap = l_table_double(L, 1, "overlap", NRF_FFT_DEFAULT_OVERLAP);
+        config.max_segments = l_table_integer(L, 1, "max_segments", 0);
+    }
+    nrf_fft* fft = nrf_fft_new_with_config(config);
+    l_to_table(L, "nrf_fft", fft);
+    return 1;
+}
+
 static int l_nrf_fft_shift(lua_State *L) {
     nrf_fft* fft = l_to_nrf_fft(L, 1);
     float d = luaL_checknumber(L, 2);
@@ -804,6 +999,21 @@ static int l_nrf_fft_get_buffer(lua_State *L) {
     return l_push_nut_buffer(L, buffer);
 }
 
+static int l_nrf_fft_get_line(lua_State *L) {
+    nrf_fft* fft = l_to_nrf_fft(L, 1);
+    nut_buffer* buffer = nrf_fft_get_line(fft);
+    return l_push_nut_buffer(L, buffer);
+}
+
+static int l_nrf_fft_get_ring_buffer(lua_State *L) {
+    nrf_fft* fft = l_to_nrf_fft(L, 1);
+    int head;
+    nut_buffer* buffer = nrf_fft_get_ring_buffer(fft, &head);
+    l_push_nut_buffer(L, buffer);
+    lua_pushinteger(L, head);
+    return 2;
+}
+
 static int l_nrf_fft_free(lua_State *L) {
     nrf_fft* fft = l_to_nrf_fft(L, 1);
     nrf_fft_free(fft);
@@ -844,6 +1054,97 @@ static int l_nrf_iq_filter_free(lua_State *L) {
     return 0;
 }
 
+// nrf_fft_filter
+
+static nrf_fft_filter* l_to_nrf_fft_filter(lua_State *L, int index) {
+    return (nrf_fft_filter*) l_from_table(L, "nrf_fft_filter", index);
+}
+
+static int l_nrf_fft_filter_new_with_config(lua_State *L) {
+    luaL_checktype(L, 1, LUA_TTABLE);
+    nrf_fft_filter_config config;
+    memset(&config, 0, sizeof(nrf_fft_filter_config));
+    config.sample_rate = l_table_integer(L, 1, "sample_rate", 10e6);
+    config.half_ampl_freq = l_table_integer(L, 1, "filter_freq", 100000);
+    config.kernel_length = l_table_integer(L, 1, "kernel_length", 255);
+    config.freq_offset = l_table_integer(L, 1, "freq_offset", 0);
+    config.decimation = l_table_integer(L, 1, "decimation", 1);
+    config.fft_size = l_table_integer(L, 1, "fft_size", 0);
+    nrf_fft_filter *filter = nrf_fft_filter_new_with_config(config);
+    l_to_table(L, "nrf_fft_filter", filter);
+    return 1;
+}
+
+static int l_nrf_fft_filter_process(lua_State *L) {
+    nrf_fft_filter *filter = l_to_nrf_fft_filter(L, 1);
+    nut_buffer *buffer = l_to_nut_buffer(L, 2);
+    nrf_fft_filter_process(filter, buffer);
+    return 0;
+}
+
+static int l_nrf_fft_filter_get_buffer(lua_State *L) {
+    nrf_fft_filter* filter = l_to_nrf_fft_filter(L, 1);
+    nut_buffer* buffer = nrf_fft_filter_get_buffer(filter);
+    return l_push_nut_buffer(L, buffer);
+}
+
+static int l_nrf_fft_filter_free(lua_State *L) {
+    nrf_fft_filter* filter = l_to_nrf_fft_filter(L, 1);
+    nrf_fft_filter_free(filter);
+    return 0;
+}
+
+// nrf_channelizer
+
+static nrf_channelizer* l_to_nrf_channelizer(lua_State *L, int index) {
+    return (nrf_channelizer*) l_from_table(L, "nrf_channelizer", index);
+}
+
+static int l_nrf_channelizer_new(lua_State *L) {
+    int n_channels = luaL_checkinteger(L, 1);
+    int taps_per_channel = luaL_optinteger(L, 2, NRF_CHANNELIZER_DEFAULT_TAPS);
+    nrf_channelizer *channelizer = nrf_channelizer_new(n_channels, taps_per_channel);
+    l_to_table(L, "nrf_channelizer", channelizer);
+    return 1;
+}
+
+static int l_nrf_channelizer_process(lua_State *L) {
+    nrf_channelizer *channelizer = l_to_nrf_channelizer(L, 1);
+    nut_buffer *buffer = l_to_nut_buffer(L, 2);
+    nrf_channelizer_process(channelizer, buffer);
+    return 0;
+}
+
+static int l_nrf_channelizer_get_buffer(lua_State *L) {
+    nrf_channelizer *channelizer = l_to_nrf_channelizer(L, 1);
+    nut_buffer *buffer = nrf_channelizer_get_buffer(channelizer);
+    return l_push_nut_buffer(L, buffer);
+}
+
+static int l_nrf_channelizer_get_channel_buffer(lua_State *L) {
+    nrf_channelizer *channelizer = l_to_nrf_channelizer(L, 1);
+    int channel = luaL_checkinteger(L, 2);
+    luaL_argcheck(L, channel >= 0 && channel < channelizer->n_channels, 2, "invalid channel");
+    nut_buffer *buffer = nrf_channelizer_get_channel_buffer(channelizer, channel);
+    return l_push_nut_buffer(L, buffer);
+}
+
+// The output blocks belong to the channelizer, so they are not freed on
+// garbage collection.
+static int l_nrf_channelizer_get_output(lua_State *L) {
+    nrf_channelizer *channelizer = l_to_nrf_channelizer(L, 1);
+    int channel = luaL_checkinteger(L, 2);
+    luaL_argcheck(L, channel >= 0 && channel < channelizer->n_channels, 2, "invalid channel");
+    l_to_table(L, "nrf_channelizer_output", nrf_channelizer_get_output(channelizer, channel));
+    return 1;
+}
+
+static int l_nrf_channelizer_free(lua_State *L) {
+    nrf_channelizer *channelizer = l_to_nrf_channelizer(L, 1);
+    nrf_channelizer_free(channelizer);
+    return 0;
+}
+
 // nrf_freq_shifter
 
 static nrf_freq_shifter* l_to_nrf_freq_shifter(lua_State *L, int index) {
@@ -865,6 +1166,13 @@ static int l_nrf_freq_shifter_process(lua_State *L) {
     return 0;
 }
 
+static int l_nrf_freq_shifter_set_freq_offset(lua_State *L) {
+    nrf_freq_shifter* shifter = l_to_nrf_freq_shifter(L, 1);
+    int freq_offset = luaL_checkinteger(L, 2);
+    nrf_freq_shifter_set_freq_offset(shifter, freq_offset);
+    return 0;
+}
+
 static int l_nrf_freq_shifter_get_buffer(lua_State *L) {
     nrf_freq_shifter* shifter = l_to_nrf_freq_shifter(L, 1);
     nut_buffer* buffer = nrf_freq_shifter_get_buffer(shifter);
@@ -898,13 +1206,41 @@ static int l_nrf_signal_detector_process(lua_State *L) {
 
 static int l_nrf_signal_detector_get_mean(lua_State *L) {
     nrf_signal_detector* detector = l_to_nrf_signal_detector(L, 1);
-    lua_pushnumber(L, detector->mean);
+    lua_pushnumber(L, nrf_signal_detector_get_stats(detector).mean);
     return 1;
 }
 
 static int l_nrf_signal_detector_get_standard_deviation(lua_State *L) {
     nrf_signal_detector* detector = l_to_nrf_signal_detector(L, 1);
-    lua_pushnumber(L, detector->standard_deviation);
+    lua_pushnumber(L, nrf_signal_detector_get_stats(detector).standard_deviation);
+    return 1;
+}
+
+static int l_nrf_signal_detector_get_stats(lua_State *L) {
+    nrf_signal_detector* detector = l_to_nrf_signal_detector(L, 1);
+    nrf_signal_stats stats = nrf_signal_detector_get_stats(detector);
+    lua_newtable(L);
+    lua_pushliteral(L, "count");
+    lua_pushinteger(L, stats.count);
+    lua_settable(L, -3);
+    lua_pushliteral(L, "mean");
+    lua_pushnumber(L, stats.mean);
+    lua_settable(L, -3);
+    lua_pushliteral(L, "variance");
+    lua_pushnumber(L, stats.variance);
+    lua_settable(L, -3);
+    lua_pushliteral(L, "standard_deviation");
+    lua_pushnumber(L, stats.standard_deviation);
+    lua_settable(L, -3);
+    lua_pushliteral(L, "peak");
+    lua_pushnumber(L, stats.peak);
+    lua_settable(L, -3);
+    lua_pushliteral(L, "rms");
+    lua_pushnumber(L, stats.rms);
+    lua_settable(L, -3);
+    lua_pushliteral(L, "crest_factor");
+    lua_pushnumber(L, stats.crest_factor);
+    lua_settable(L, -3);
     return 1;
 }
 
@@ -914,6 +1250,62 @@ static int l_nrf_signal_detector_free(lua_State *L) {
     return 0;
 }
 
+// nrf_carrier_detector
+
+static nrf_carrier_detector* l_to_nrf_carrier_detector(lua_State *L, int index) {
+    return (nrf_carrier_detector*) l_from_table(L, "nrf_carrier_detector", index);
+}
+
+static int l_nrf_carrier_detector_new(lua_State *L) {
+    nrf_carrier_detector_config config;
+    memset(&config, 0, sizeof(nrf_carrier_detector_config));
+    config.threshold_db = NRF_CARRIER_DETECTOR_DEFAULT_THRESHOLD_DB;
+    if (lua_istable(L, 1)) {
+        config.fft_size = l_table_integer(L, 1, "fft_size", DEFAULT_FFT_SIZE);
+        config.guard_cells = l_table_integer(L, 1, "guard_cells", NRF_CARRIER_DETECTOR_DEFAULT_GUARD_CELLS);
+        config.training_cells = l_table_integer(L, 1, "training_cells", NRF_CARRIER_DETECTOR_DEFAULT_TRAINING_CELLS);
+        config.threshold_db = l_table_double(L, 1, "threshold_db", NRF_CARRIER_DETECTOR_DEFAULT_THRESHOLD_DB);
+        config.input_db = l_table_integer(L, 1, "input_db", 0);
+    }
+    nrf_carrier_detector *detector = nrf_carrier_detector_new(config);
+    l_to_table(L, "nrf_carrier_detector", detector);
+    return 1;
+}
+
+static int l_nrf_carrier_detector_process(lua_State *L) {
+    nrf_carrier_detector* detector = l_to_nrf_carrier_detector(L, 1);
+    nut_buffer* buffer = l_to_nut_buffer(L, 2);
+    nrf_carrier_detector_process(detector, buffer);
+    return 0;
+}
+
+static int l_nrf_carrier_detector_get_carriers(lua_State *L) {
+    nrf_carrier_detector* detector = l_to_nrf_carrier_detector(L, 1);
+    nrf_carrier carriers[NRF_CARRIER_DETECTOR_MAX_CARRIERS];
+    int n = nrf_carrier_detector_get_carriers(detector, carriers, NRF_CARRIER_DETECTOR_MAX_CARRIERS);
+    lua_createtable(L, n, 0);
+    for (int i = 0; i < n; i++) {
+        lua_newtable(L);
+        lua_pushliteral(L, "bin");
+        lua_pushinteger(L, carriers[i].bin);
+        lua_settable(L, -3);
+        lua_pushliteral(L, "power");
+        lua_pushnumber(L, carriers[i].power_db);
+        lua_settable(L, -3);
+        lua_pushliteral(L, "snr");
+        lua_pushnumber(L, carriers[i].snr_db);
+        lua_settable(L, -3);
+        lua_rawseti(L, -2, i + 1);
+    }
+    return 1;
+}
+
+static int l_nrf_carrier_detector_free(lua_State *L) {
+    nrf_carrier_detector* detector = l_to_nrf_carrier_detector(L, 1);
+    nrf_carrier_detector_free(detector);
+    return 0;
+}
+
 // nrf_player
 
 static nrf_player* l_to_nrf_player(lua_State *L, int index) {
@@ -943,12 +1335,81 @@ static int l_nrf_player_set_gain(lua_State *L) {
     return 0;
 }
 
+static int l_nrf_player_set_latency(lua_State *L) {
+    nrf_player* player = l_to_nrf_player(L, 1);
+    int latency_ms = luaL_checkinteger(L, 2);
+    nrf_player_set_latency(player, latency_ms);
+    return 0;
+}
+
+static int l_nrf_player_get_stats(lua_State *L) {
+    nrf_player* player = l_to_nrf_player(L, 1);
+    nrf_player_stats stats = nrf_player_get_stats(player);
+    lua_newtable(L);
+
+    lua_pushliteral(L, "underruns");
+    lua_pushinteger(L, stats.underruns);
+    lua_settable(L, -3);
+
+    lua_pushliteral(L, "overruns");
+    lua_pushinteger(L, stats.overruns);
+    lua_settable(L, -3);
+
+    lua_pushliteral(L, "latency_ms");
+    lua_pushnumber(L, stats.latency_ms);
+    lua_settable(L, -3);
+
+    return 1;
+}
+
 static int l_nrf_player_free(lua_State *L) {
     nrf_player* player = l_to_nrf_player(L, 1);
     nrf_player_free(player);
     return 0;
 }
 
+// nrf_decode_file
+
+static int l_nrf_decode_file(lua_State *L) {
+    const char *in_file = luaL_checkstring(L, 1);
+    const char *out_file = luaL_checkstring(L, 2);
+    nrf_decode_file_config config;
+    memset(&config, 0, sizeof(nrf_decode_file_config));
+    config.demodulate_type = NRF_DEMODULATE_WBFM;
+    if (lua_istable(L, 3)) {
+        config.demodulate_type = (nrf_demodulate_type) l_table_integer(L, 3, "demodulate_type", NRF_DEMODULATE_WBFM);
+        config.sample_rate = l_table_integer(L, 3, "sample_rate", 0);
+        config.out_sample_rate = l_table_integer(L, 3, "out_sample_rate", 0);
+        config.freq_offset = l_table_integer(L, 3, "freq_offset", 0);
+        config.format = (nrf_audio_format) l_table_integer(L, 3, "format", NRF_AUDIO_FORMAT_WAV);
+    }
+    nrf_decode_file_stats stats;
+    int status = nrf_decode_file(in_file, out_file, config, &stats);
+    if (status != 0) {
+        lua_pushnil(L);
+        return 1;
+    }
+    lua_newtable(L);
+
+    lua_pushliteral(L, "in_samples");
+    lua_pushinteger(L, stats.in_samples);
+    lua_settable(L, -3);
+
+    lua_pushliteral(L, "out_samples");
+    lua_pushinteger(L, stats.out_samples);
+    lua_settable(L, -3);
+
+    lua_pushliteral(L, "seconds");
+    lua_pushnumber(L, stats.seconds);
+    lua_settable(L, -3);
+
+    lua_pushliteral(L, "msps");
+    lua_pushnumber(L, stats.msps);
+    lua_settable(L, -3);
+
+    return 1;
+}
+
 // Main /////////////////////////////////////////////////////////////////////
 
 int use_vr = 0;
@@ -1092,7 +1553,7 @@ static lua_State *l_init() {
     lua_State *L = luaL_newstate();
     luaL_openlibs(L);
 
-    l_register_type(L, "nut_buffer", l_nut_buffer_free);
+    l_register_type(L, "nut_buffer", l_nut_buffer_release);
     l_register_type(L, "ngl_camera", l_ngl_camera_free);
     l_register_type(L, "ngl_model", l_ngl_model_free);
     l_register_type(L, "ngl_shader", l_ngl_shader_free);
@@ -1102,10 +1563,16 @@ static lua_State *l_init() {
     l_register_type(L, "nosc_server", l_nosc_server_free);
     l_register_type(L, "nrf_device", l_nrf_device_free);
     l_register_type(L, "nrf_interpolator", l_nrf_interpolator_free);
+    l_register_type(L, "nrf_iq_converter", l_nrf_iq_converter_free);
+    l_register_type(L, "nrf_iq_density", l_nrf_iq_density_free);
     l_register_type(L, "nrf_fft", l_nrf_fft_free);
     l_register_type(L, "nrf_iq_filter", l_nrf_iq_filter_free);
+    l_register_type(L, "nrf_fft_filter", l_nrf_fft_filter_free);
+    l_register_type(L, "nrf_channelizer", l_nrf_channelizer_free);
+    l_register_type(L, "nrf_channelizer_output", NULL);
     l_register_type(L, "nrf_freq_shifter", l_nrf_freq_shifter_free);
     l_register_type(L, "nrf_signal_detector", l_nrf_signal_detector_free);
+    l_register_type(L, "nrf_carrier_detector", l_nrf_carrier_detector_free);
     l_register_type(L, "nrf_player", l_nrf_player_free);
 
     l_register_function(L, "nut_buffer_append", l_nut_buffer_append);
@@ -1113,6 +1580,8 @@ static lua_State *l_init() {
     l_register_function(L, "nut_buffer_clip", l_nut_buffer_clip);
     l_register_function(L, "nut_buffer_convert", l_nut_buffer_convert);
     l_register_function(L, "nut_buffer_save", l_nut_buffer_save);
+    l_register_function(L, "nut_buffer_get_pool_stats", l_nut_buffer_get_pool_stats);
+    l_register_function(L, "nut_buffer_pool_trim", l_nut_buffer_pool_trim);
     l_register_function(L, "nwm_get_time", l_nwm_get_time);
     l_register_function(L, "ngl_clear", l_ngl_clear);
     l_register_function(L, "ngl_clear_depth", l_ngl_clear_depth);
@@ -1145,12 +1614,17 @@ static lua_State *l_init() {
     l_register_function(L, "nosc_server_new", l_nosc_server_new);
     l_register_function(L, "nosc_server_update", l_nosc_server_update);
     l_register_function(L, "nrf_block_connect", l_nrf_block_connect);
+    l_register_function(L, "nrf_block_connect_with_config", l_nrf_block_connect_with_config);
     l_register_function(L, "nrf_device_new", l_nrf_device_new);
     l_register_function(L, "nrf_device_new_with_config", l_nrf_device_new_with_config);
     l_register_function(L, "nrf_device_set_frequency", l_nrf_device_set_frequency);
     l_register_function(L, "nrf_device_set_paused", l_nrf_device_set_paused);
     l_register_function(L, "nrf_device_step", l_nrf_device_step);
+    l_register_function(L, "nrf_device_seek", l_nrf_device_seek);
+    l_register_function(L, "nrf_device_seek_time", l_nrf_device_seek_time);
     l_register_function(L, "nrf_device_get_samples_buffer", l_nrf_device_get_samples_buffer);
+    l_register_function(L, "nrf_device_next_samples_buffer", l_nrf_device_next_samples_buffer);
+    l_register_function(L, "nrf_device_get_stats", l_nrf_device_get_stats);
     l_register_function(L, "nrf_device_get_iq_buffer", l_nrf_device_get_iq_buffer);
     l_register_function(L, "nrf_device_get_iq_lines", l_nrf_device_get_iq_lines);
     l_register_function(L, "nrf_interpolator_new", l_nrf_interpolator_new);
@@ -1159,27 +1633,77 @@ static lua_State *l_init() {
     l_register_function(L, "nrf_buffer_add_position_channel", l_nrf_buffer_add_position_channel);
     l_register_function(L, "nrf_buffer_to_iq_points", l_nrf_buffer_to_iq_points);
     l_register_function(L, "nrf_buffer_to_iq_lines", l_nrf_buffer_to_iq_lines);
+    l_register_function(L, "nrf_buffer_to_iq_lines_antialiased", l_nrf_buffer_to_iq_lines_antialiased);
+    l_register_function(L, "nrf_iq_converter_new", l_nrf_iq_converter_new);
+    l_register_function(L, "nrf_iq_converter_process", l_nrf_iq_converter_process);
+    l_register_function(L, "nrf_iq_converter_get_buffer", l_nrf_iq_converter_get_buffer);
+    l_register_function(L, "nrf_iq_density_new", l_nrf_iq_density_new);
+    l_register_function(L, "nrf_iq_density_process", l_nrf_iq_density_process);
+    l_register_function(L, "nrf_iq_density_clear", l_nrf_iq_density_clear);
+    l_register_function(L, "nrf_iq_density_get_buffer", l_nrf_iq_density_get_buffer);
     l_register_function(L, "nrf_fft_new", l_nrf_fft_new);
+    l_register_function(L, "nrf_fft_new_with_config", l_nrf_fft_new_with_config);
     l_register_function(L, "nrf_fft_shift", l_nrf_fft_shift);
     l_register_function(L, "nrf_fft_process", l_nrf_fft_process);
     l_register_function(L, "nrf_fft_get_buffer", l_nrf_fft_get_buffer);
+    l_register_function(L, "nrf_fft_get_line", l_nrf_fft_get_line);
+    l_register_function(L, "nrf_fft_get_ring_buffer", l_nrf_fft_get_ring_buffer);
     l_register_function(L, "nrf_iq_filter_new", l_nrf_iq_filter_new);
     l_register_function(L, "nrf_iq_filter_process", l_nrf_iq_filter_process);
     l_register_function(L, "nrf_iq_filter_get_buffer", l_nrf_iq_filter_get_buffer);
     l_register_function(L, "nrf_iq_filter_new", l_nrf_iq_filter_new);
+    l_register_function(L, "nrf_fft_filter_new_with_config", l_nrf_fft_filter_new_with_config);
+    l_register_function(L, "nrf_fft_filter_process", l_nrf_fft_filter_process);
+    l_register_function(L, "nrf_fft_filter_get_buffer", l_nrf_fft_filter_get_buffer);
+    l_register_function(L, "nrf_channelizer_new", l_nrf_channelizer_new);
+    l_register_function(L, "nrf_channelizer_process", l_nrf_channelizer_process);
+    l_register_function(L, "nrf_channelizer_get_buffer", l_nrf_channelizer_get_buffer);
+    l_register_function(L, "nrf_channelizer_get_channel_buffer", l_nrf_channelizer_get_channel_buffer);
+    l_register_function(L, "nrf_channelizer_get_output", l_nrf_channelizer_get_output);
     l_register_function(L, "nrf_freq_shifter_new", l_nrf_freq_shifter_new);
     l_register_function(L, "nrf_freq_shifter_process", l_nrf_freq_shifter_process);
+    l_register_function(L, "nrf_freq_shifter_set_freq_offset", l_nrf_freq_shifter_set_freq_offset);
     l_register_function(L, "nrf_freq_shifter_get_buffer", l_nrf_freq_shifter_get_buffer);
     l_register_function(L, "nrf_signal_detector_new", l_nrf_signal_detector_new);
     l_register_function(L, "nrf_signal_detector_process", l_nrf_signal_detector_process);
     l_register_function(L, "nrf_signal_detector_get_mean", l_nrf_signal_detector_get_mean);
     l_register_function(L, "nrf_signal_detector_get_standard_deviation", l_nrf_signal_detector_get_standard_deviation);
+    l_register_function(L, "nrf_signal_detector_get_stats", l_nrf_signal_detector_get_stats);
+    l_register_function(L, "nrf_carrier_detector_new", l_nrf_carrier_detector_new);
+    l_register_function(L, "nrf_carrier_detector_process", l_nrf_carrier_detector_process);
+    l_register_function(L, "nrf_carrier_detector_get_carriers", l_nrf_carrier_detector_get_carriers);
     l_register_function(L, "nrf_player_new", l_nrf_player_new);
     l_register_function(L, "nrf_player_set_freq_offset", l_nrf_player_set_freq_offset);
     l_register_function(L, "nrf_player_set_gain", l_nrf_player_set_gain);
-
+    l_register_function(L, "nrf_player_set_latency", l_nrf_player_set_latency);
+    l_register_function(L, "nrf_player_get_stats", l_nrf_player_get_stats);
+    l_register_function(L, "nrf_decode_file", l_nrf_decode_file);
+
+    l_register_constant(L, "NRF_EDGE_SYNC", NRF_EDGE_SYNC);
+    l_register_constant(L, "NRF_EDGE_BLOCK", NRF_EDGE_BLOCK);
+    l_register_constant(L, "NRF_EDGE_DROP_NEWEST", NRF_EDGE_DROP_NEWEST);
+    l_register_constant(L, "NRF_EDGE_DROP_OLDEST", NRF_EDGE_DROP_OLDEST);
+    l_register_constant(L, "NRF_REPLAY_REALTIME", NRF_REPLAY_REALTIME);
+    l_register_constant(L, "NRF_REPLAY_FREE_RUN", NRF_REPLAY_FREE_RUN);
+    l_register_constant(L, "NRF_DEMODULATE_RAW", NRF_DEMODULATE_RAW);
+    l_register_constant(L, "NRF_DEMODULATE_WBFM", NRF_DEMODULATE_WBFM);
+    l_register_constant(L, "NRF_DEMODULATE_NBFM", NRF_DEMODULATE_NBFM);
+    l_register_constant(L, "NRF_DEMODULATE_AM", NRF_DEMODULATE_AM);
+    l_register_constant(L, "NRF_DEMODULATE_USB", NRF_DEMODULATE_USB);
+    l_register_constant(L, "NRF_DEMODULATE_LSB", NRF_DEMODULATE_LSB);
+    l_register_constant(L, "NRF_AUDIO_FORMAT_WAV", NRF_AUDIO_FORMAT_WAV);
+    l_register_constant(L, "NRF_AUDIO_FORMAT_RAW", NRF_AUDIO_FORMAT_RAW);
+    l_register_constant(L, "NRF_IQ_DENSITY_SATURATE", NRF_IQ_DENSITY_SATURATE);
+    l_register_constant(L, "NRF_IQ_DENSITY_LOG", NRF_IQ_DENSITY_LOG);
+    l_register_constant(L, "NRF_WINDOW_NONE", NRF_WINDOW_NONE);
+    l_register_constant(L, "NRF_WINDOW_HANN", NRF_WINDOW_HANN);
+    l_register_constant(L, "NRF_WINDOW_BLACKMAN_HARRIS", NRF_WINDOW_BLACKMAN_HARRIS);
+    l_register_constant(L, "NRF_WINDOW_FLAT_TOP", NRF_WINDOW_FLAT_TOP);
     l_register_constant(L, "NUT_BUFFER_U8", NUT_BUFFER_U8);
     l_register_constant(L, "NUT_BUFFER_F64", NUT_BUFFER_F64);
+    l_register_constant(L, "NUT_BUFFER_F32", NUT_BUFFER_F32);
+    l_register_constant(L, "NUT_BUFFER_CF32", NUT_BUFFER_CF32);
+    l_register_constant(L, "NUT_BUFFER_S16", NUT_BUFFER_S16);
     l_register_constant(L, "NWM_PLATFORM", NWM_PLATFORM);
     l_register_constant(L, "NWM_OPENGL_TYPE", NWM_OPENGL_TYPE);
     l_register_constant(L, "NWM_WIN32", NWM_WIN32);
@@ -228,12 +228,14 @@ void ngl_texture_update(ngl_texture *texture, nut_buffer *buffer, int width, int
 
     if (buffer->type == NUT_BUFFER_U8) {
         glTexImage2D(GL_TEXTURE_2D, 0, format, width, height, 0, format, GL_UNSIGNED_BYTE, buffer->data.u8);
+    } else if (buffer->type == NUT_BUFFER_S16) {
+        glTexImage2D(GL_TEXTURE_2D, 0, format, width, height, 0, format, GL_SHORT, buffer->data.s16);
+    } else if (buffer->type == NUT_BUFFER_F32 || buffer->type == NUT_BUFFER_CF32) {
+        glTexImage2D(GL_TEXTURE_2D, 0, format, width, height, 0, format, GL_FLOAT, buffer->data.f32);
     } else {
         const int size = width * height * buffer->channels;
         float *tex = calloc(size, sizeof(float));
-        for (int i = 0; i < size; i++) {
-            tex[i] = (float) buffer->data.f64[i];
-        }
+        nut_buffer_read_f32(buffer, 0, size, tex);
         glTexImage2D(GL_TEXTURE_2D, 0, format, width, height, 0, format, GL_FLOAT, tex);
         free(tex);
     }
@@ -309,11 +311,12 @@ ngl_model* ngl_model_new(int component_count, int point_count, float* positions,
 }
 
 ngl_model* ngl_model_new_with_buffer(nut_buffer *buffer) {
+    if (buffer->type == NUT_BUFFER_F32 || buffer->type == NUT_BUFFER_CF32) {
+        return ngl_model_new(buffer->channels, buffer->length, buffer->data.f32, NULL, NULL);
+    }
     int size = buffer->channels * buffer->length;
     float *positions = calloc(size, sizeof(float));
-    for (int i = 0; i < size; i++) {
-        positions[i] = nut_buffer_get_f64(buffer, i);
-    }
+    nut_buffer_read_f32(buffer, 0, size, positions);
     ngl_model *model = ngl_model_new(buffer->channels, buffer->length, positions, NULL, NULL);
     free(positions);
     return model;
@@ -1,13 +1,27 @@
 // NDBX Radio Frequency functions, based on HackRF
 
+#if __STDC_VERSION__ >= 199901L
+#define _XOPEN_SOURCE 600
+#else
+#define _XOPEN_SOURCE 500
+#endif /* __STDC_VERSION__ */
+
 #include <assert.h>
+#include <fcntl.h>
+#include <float.h>
 #include <math.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
 #include <pthread.h>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
 #include <libhackrf/hackrf.h>
 #include <rtl-sdr.h>
 
@@ -26,12 +40,124 @@ void nrf_block_init(nrf_block* block, nrf_block_type type, nrf_block_process_fn
     block->process_fn = process_fn;
     block->result_fn = result_fn;
     assert(block->n_outputs == 0);
+    pthread_mutex_init(&block->outputs_mutex, NULL);
+}
+
+// Take the next buffer from the input queues, taking turns between inputs.
+// The worker mutex must be held.
+static nut_buffer *_nrf_block_pop_input(nrf_block *block) {
+    for (int i = 0; i < block->n_inputs; i++) {
+        int index = (block->next_input + i) % block->n_inputs;
+        nrf_edge *edge = block->inputs[index];
+        if (edge->count > 0) {
+            nut_buffer *buffer = edge->queue[edge->head];
+            edge->head = (edge->head + 1) % edge->config.queue_length;
+            edge->count--;
+            block->next_input = (index + 1) % block->n_inputs;
+            return buffer;
+        }
+    }
+    return NULL;
+}
+
+static void *_nrf_block_worker_loop(nrf_block *block) {
+    pthread_mutex_lock(&block->worker_mutex);
+    while (block->worker_running) {
+        nut_buffer *buffer = _nrf_block_pop_input(block);
+        if (buffer == NULL) {
+            pthread_cond_wait(&block->input_cond, &block->worker_mutex);
+            continue;
+        }
+        pthread_cond_broadcast(&block->space_cond);
+        pthread_mutex_unlock(&block->worker_mutex);
+        nrf_block_process(block, buffer);
+        nut_buffer_release(buffer);
+        pthread_mutex_lock(&block->worker_mutex);
+    }
+    pthread_mutex_unlock(&block->worker_mutex);
+    return NULL;
+}
+
+// Queue the buffer for the output block. This takes over the reference.
+static void _nrf_edge_push(nrf_block *output, nrf_edge *edge, nut_buffer *buffer) {
+    pthread_mutex_lock(&output->worker_mutex);
+    if (edge->count == edge->config.queue_length) {
+        if (edge->config.policy == NRF_EDGE_BLOCK) {
+            while (edge->count == edge->config.queue_length && output->worker_running) {
+                pthread_cond_wait(&output->space_cond, &output->worker_mutex);
+            }
+        } else if (edge->config.policy == NRF_EDGE_DROP_NEWEST) {
+            edge->dropped++;
+            pthread_mutex_unlock(&output->worker_mutex);
+            nut_buffer_release(buffer);
+            return;
+        } else {
+            nut_buffer_release(edge->queue[edge->head]);
+            edge->head = (edge->head + 1) % edge->config.queue_length;
+            edge->count--;
+            edge->dropped++;
+        }
+    }
+    if (!output->worker_running) {
+        pthread_mutex_unlock(&output->worker_mutex);
+        nut_buffer_release(buffer);
+        return;
+    }
+    edge->queue[(edge->head + edge->count) % edge->config.queue_length] = buffer;
+    edge->count++;
+    edge->pushed++;
+    pthread_cond_signal(&output->input_cond);
+    pthread_mutex_unlock(&output->worker_mutex);
+}
+
+static void _nrf_block_start_worker(nrf_block *block) {
+    pthread_mutex_init(&block->worker_mutex, NULL);
+    pthread_cond_init(&block->input_cond, NULL);
+    pthread_cond_init(&block->space_cond, NULL);
+    block->worker_running = 1;
+    pthread_create(&block->worker_thread, NULL, (void *(*)(void *)) &_nrf_block_worker_loop, block);
 }
 
 void nrf_block_connect(nrf_block* input, nrf_block* output) {
+    nrf_edge_config config;
+    memset(&config, 0, sizeof(nrf_edge_config));
+    nrf_block_connect_with_config(input, output, config);
+}
+
+// Connect the blocks. Unless the policy is NRF_EDGE_SYNC, the output block
+// gets its own thread, and the buffers are queued. A block can't have both
+// synchronous and queued inputs, or it would run on two threads at once.
+void nrf_block_connect_with_config(nrf_block* input, nrf_block* output, nrf_edge_config config) {
     assert(input->n_outputs < NRF_BLOCK_MAX_OUTPUTS);
+    assert(output->n_inputs < NRF_BLOCK_MAX_INPUTS);
+    int queued = config.policy != NRF_EDGE_SYNC;
+    assert(output->n_inputs == 0 || queued == (output->inputs[0]->config.policy != NRF_EDGE_SYNC));
+    nrf_edge *edge = calloc(1, sizeof(nrf_edge));
+    edge->config = config;
+    edge->producer = input;
+    edge->consumer = output;
+    if (queued) {
+        if (edge->config.queue_length <= 0) {
+            edge->config.queue_length = NRF_EDGE_DEFAULT_QUEUE_LENGTH;
+        }
+        edge->queue = calloc(edge->config.queue_length, sizeof(nut_buffer *));
+        if (!output->worker_running) {
+            _nrf_block_start_worker(output);
+        }
+        pthread_mutex_lock(&output->worker_mutex);
+        output->inputs[output->n_inputs] = edge;
+        output->n_inputs++;
+        pthread_mutex_unlock(&output->worker_mutex);
+    } else {
+        output->inputs[output->n_inputs] = edge;
+        output->n_inputs++;
+    }
+    // The input block may already be running on another thread.
+    pthread_mutex_lock(&input->outputs_mutex);
     input->outputs[input->n_outputs] = output;
+    input->edges[input->n_outputs] = edge;
     input->n_outputs++;
+    pthread_mutex_unlock(&input->outputs_mutex);
 }
 
 void nrf_block_process(nrf_block* block, nut_buffer* buffer) {
@@ -39,14 +165,270 @@ void nrf_block_process(nrf_block* block, nut_buffer* buffer) {
         block->process_fn(block, buffer);
     }
 
-    if (block->n_outputs > 0) {
+    // The result is usually a view of the block's own output, not a copy.
+    // Each output gets its own view; the last one gets the result itself. If
+    // nothing else shares the data by then, that block can process it in
+    // place (see nut_buffer_is_writable).
+    pthread_mutex_lock(&block->outputs_mutex);
+    int n_outputs = block->n_outputs;
+    if (n_outputs > 0) {
         nut_buffer *result = block->result_fn(block);
-        for (int i = 0; i < block->n_outputs; i++) {
+        for (int i = 0; i < n_outputs; i++) {
             nrf_block *output = block->outputs[i];
-            nrf_block_process(output, result);
+            nrf_edge *edge = block->edges[i];
+            nut_buffer *view = i < n_outputs - 1 ? nut_buffer_copy(result) : result;
+            if (edge->config.policy == NRF_EDGE_SYNC) {
+                nrf_block_process(output, view);
+                nut_buffer_release(view);
+            } else {
+                _nrf_edge_push(output, edge, view);
+            }
+        }
+    }
+    pthread_mutex_unlock(&block->outputs_mutex);
+}
+
+// Removes the edge from the outputs of its producer. This waits until the
+// producer is done passing on its current buffer.
+static void _nrf_edge_unlink(nrf_edge *edge) {
+    nrf_block *producer = edge->producer;
+    if (producer == NULL) return;
+    pthread_mutex_lock(&producer->outputs_mutex);
+    int j = 0;
+    for (int i = 0; i < producer->n_outputs; i++) {
+        if (producer->edges[i] != edge) {
+            producer->outputs[j] = producer->outputs[i];
+            producer->edges[j] = producer->edges[i];
+            j++;
+        }
+    }
+    producer->n_outputs = j;
+    pthread_mutex_unlock(&producer->outputs_mutex);
+    edge->producer = NULL;
+}
+
+// Disconnect the block from the blocks on either side, stop the worker
+// thread and drop queued buffers. Blocks can be freed in any order, but
+// not while another thread connects or frees blocks.
+void nrf_block_deinit(nrf_block* block) {
+    // A producer blocked on a full queue sees that the worker stopped and
+    // drops its buffer, so unlinking doesn't wait for it forever. After
+    // unlinking, no producer touches the queues any more.
+    int had_worker = block->worker_running;
+    if (had_worker) {
+        pthread_mutex_lock(&block->worker_mutex);
+        block->worker_running = 0;
+        pthread_cond_broadcast(&block->input_cond);
+        pthread_cond_broadcast(&block->space_cond);
+        pthread_mutex_unlock(&block->worker_mutex);
+    }
+    for (int i = 0; i < block->n_inputs; i++) {
+        _nrf_edge_unlink(block->inputs[i]);
+    }
+    if (had_worker) {
+        pthread_join(block->worker_thread, NULL);
+        pthread_mutex_destroy(&block->worker_mutex);
+        pthread_cond_destroy(&block->input_cond);
+        pthread_cond_destroy(&block->space_cond);
+    }
+    for (int i = 0; i < block->n_inputs; i++) {
+        nrf_edge *edge = block->inputs[i];
+        for (int j = 0; j < edge->count; j++) {
+            nut_buffer_release(edge->queue[(edge->head + j) % edge->config.queue_length]);
+        }
+        free(edge->queue);
+        free(edge);
+    }
+    block->n_inputs = 0;
+
+    // The edges to the outputs belong to them; they only forget us.
+    pthread_mutex_lock(&block->outputs_mutex);
+    for (int i = 0; i < block->n_outputs; i++) {
+        block->edges[i]->producer = NULL;
+    }
+    block->n_outputs = 0;
+    pthread_mutex_unlock(&block->outputs_mutex);
+    pthread_mutex_destroy(&block->outputs_mutex);
+}
+
+// IQ conversion
+
+// Sums of the samples, their squares and the I * Q products, centered on
+// 128. Integer sums are exact and vectorize without reassociating floats.
+typedef struct {
+    int64_t i, q, ii, qq, iq;
+} _nrf_iq_sums;
+
+// The products are at most 2^14, so chunks of 2^16 samples fit in 32 bits.
+#define NRF_IQ_SUMS_CHUNK 65536
+
+static inline _nrf_iq_sums _nrf_iq_sums_body(const uint8_t *restrict in, int length) {
+    _nrf_iq_sums sums = { 0, 0, 0, 0, 0 };
+    for (int start = 0; start < length; start += NRF_IQ_SUMS_CHUNK) {
+        int end = start + NRF_IQ_SUMS_CHUNK < length ? start + NRF_IQ_SUMS_CHUNK : length;
+        int32_t si = 0, sq = 0, sii = 0, sqq = 0, siq = 0;
+        for (int k = start; k < end; k++) {
+            int32_t vi = in[k * 2] - 128;
+            int32_t vq = in[k * 2 + 1] - 128;
+            si += vi;
+            sq += vq;
+            sii += vi * vi;
+            sqq += vq * vq;
+            siq += vi * vq;
+        }
+        sums.i += si;
+        sums.q += sq;
+        sums.ii += sii;
+        sums.qq += sqq;
+        sums.iq += siq;
+    }
+    return sums;
+}
+
+// out_i = u_i * ci + oi, out_q = u_i * cqi + u_q * cqq + oq
+static inline void _nrf_iq_convert_body(const uint8_t *restrict in, int length, const float *restrict coefs, float *restrict out) {
+    const float ci = coefs[0], oi = coefs[1], cqi = coefs[2], cqq = coefs[3], oq = coefs[4];
+    for (int k = 0; k < length; k++) {
+        float ui = in[k * 2];
+        float uq = in[k * 2 + 1];
+        out[k * 2] = ui * ci + oi;
+        out[k * 2 + 1] = ui * cqi + uq * cqq + oq;
+    }
+}
+
+static _nrf_iq_sums _nrf_iq_sums_default(const uint8_t *in, int length) {
+    return _nrf_iq_sums_body(in, length);
+}
+
+static void _nrf_iq_convert_default(const uint8_t *in, int length, const float *coefs, float *out) {
+    _nrf_iq_convert_body(in, length, coefs, out);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+__attribute__((target("avx2,fma")))
+static _nrf_iq_sums _nrf_iq_sums_avx2(const uint8_t *in, int length) {
+    return _nrf_iq_sums_body(in, length);
+}
+
+__attribute__((target("avx2,fma")))
+static void _nrf_iq_convert_avx2(const uint8_t *in, int length, const float *coefs, float *out) {
+    _nrf_iq_convert_body(in, length, coefs, out);
+}
+
+#endif
+
+static _nrf_iq_sums (*_nrf_iq_sums_fn)(const uint8_t *in, int length) = _nrf_iq_sums_default;
+static void (*_nrf_iq_convert_fn)(const uint8_t *in, int length, const float *coefs, float *out) = _nrf_iq_convert_default;
+static pthread_once_t _nrf_iq_kernel_once = PTHREAD_ONCE_INIT;
+
+static void _nrf_iq_select_kernel() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        _nrf_iq_sums_fn = _nrf_iq_sums_avx2;
+        _nrf_iq_convert_fn = _nrf_iq_convert_avx2;
+    }
+#endif
+}
+
+nrf_iq_converter *nrf_iq_converter_new(int dc_removal, int iq_balance) {
+    nrf_iq_converter_config config;
+    memset(&config, 0, sizeof(nrf_iq_converter_config));
+    config.dc_removal = dc_removal;
+    config.iq_balance = iq_balance;
+    return nrf_iq_converter_new_with_config(config);
+}
+
+nrf_iq_converter *nrf_iq_converter_new_with_config(nrf_iq_converter_config config) {
+    nrf_iq_converter *c = calloc(1, sizeof(nrf_iq_converter));
+    nrf_block_init(&c->block, NRF_BLOCK_GENERIC, (nrf_block_process_fn) nrf_iq_converter_process, (nrf_block_result_fn) nrf_iq_converter_get_buffer);
+    if (config.averaging <= 0) {
+        config.averaging = NRF_IQ_CONVERTER_DEFAULT_AVERAGING;
+    }
+    c->config = config;
+    c->mean_i = 127.5;
+    c->mean_q = 127.5;
+    return c;
+}
+
+// Update the running estimates with the statistics of this block. The
+// first block sets them directly.
+static void _nrf_iq_converter_update(nrf_iq_converter *c, const uint8_t *in, int length) {
+    _nrf_iq_sums sums = _nrf_iq_sums_fn(in, length);
+    double mi = (double) sums.i / length;
+    double mq = (double) sums.q / length;
+    double vi = (double) sums.ii / length - mi * mi;
+    double vq = (double) sums.qq / length - mq * mq;
+    double viq = (double) sums.iq / length - mi * mq;
+    double alpha = c->has_estimates ? 1 - exp(-(double) length / c->config.averaging) : 1;
+    c->mean_i += alpha * (mi + 128 - c->mean_i);
+    c->mean_q += alpha * (mq + 128 - c->mean_q);
+    c->var_i += alpha * (vi - c->var_i);
+    c->var_q += alpha * (vq - c->var_q);
+    c->cov_iq += alpha * (viq - c->cov_iq);
+    c->has_estimates = 1;
+}
+
+// Convert length interleaved I/Q byte pairs to 2 * length floats in the
+// range -1 to 1. Without DC removal, 127.5 is taken as zero. The balance
+// correction removes the part of Q that correlates with I, then scales Q to
+// the power of I.
+void nrf_iq_converter_convert(nrf_iq_converter *c, const uint8_t *in, int length, float *out) {
+    pthread_once(&_nrf_iq_kernel_once, _nrf_iq_select_kernel);
+    if (length <= 0) return;
+    if (c->config.dc_removal || c->config.iq_balance) {
+        _nrf_iq_converter_update(c, in, length);
+    }
+    double mi = c->config.dc_removal ? c->mean_i : 127.5;
+    double mq = c->config.dc_removal ? c->mean_q : 127.5;
+    double cross = 0;
+    double gain = 1;
+    if (c->config.iq_balance && c->var_i > 0) {
+        double var_q = c->var_q - c->cov_iq * c->cov_iq / c->var_i;
+        if (var_q > 0) {
+            cross = c->cov_iq / c->var_i;
+            gain = sqrt(c->var_i / var_q);
         }
-        nut_buffer_free(result);
     }
+    const double scale = 1.0 / 128;
+    float coefs[5];
+    coefs[0] = scale;
+    coefs[1] = -mi * scale;
+    coefs[2] = -gain * cross * scale;
+    coefs[3] = gain * scale;
+    coefs[4] = gain * (cross * mi - mq) * scale;
+    _nrf_iq_convert_fn(in, length, coefs, out);
+}
+
+// Takes a buffer of raw samples, as produced by the device.
+void nrf_iq_converter_process(nrf_iq_converter *c, nut_buffer *buffer) {
+    assert(buffer->type == NUT_BUFFER_U8);
+    assert(buffer->channels == 2);
+    // A held output would be copied only to be overwritten; start a new one.
+    if (c->buffer != NULL && (c->buffer->length != buffer->length || !nut_buffer_is_writable(c->buffer))) {
+        nut_buffer_release(c->buffer);
+        c->buffer = NULL;
+    }
+    if (c->buffer == NULL) {
+        c->buffer = nut_buffer_new_cf32(buffer->length, 2, NULL);
+    }
+    nrf_iq_converter_convert(c, buffer->data.u8, buffer->length, c->buffer->data.f32);
+}
+
+nut_buffer *nrf_iq_converter_get_buffer(nrf_iq_converter *c) {
+    if (c->buffer == NULL) {
+        return nut_buffer_new_cf32(0, 2, NULL);
+    }
+    return nut_buffer_copy(c->buffer);
+}
+
+void nrf_iq_converter_free(nrf_iq_converter *c) {
+    nrf_block_deinit(&c->block);
+    if (c->buffer != NULL) {
+        nut_buffer_release(c->buffer);
+    }
+    free(c);
 }
 
 // Device
@@ -92,41 +474,51 @@ double _nrf_clamp_frequency(nrf_device *device, double freq_mhz) {
     }
 }
 
-static int _nrf_process_sample_block(nrf_device *device, uint8_t *buffer, int length) {
+// Marks a ring slot that is being overwritten.
+#define NRF_SLOT_WRITING UINT64_MAX
+
+// Called on the receive thread for every block of samples. The block is
+// converted into the receive store, shared with the connected blocks, and
+// copied into the oldest slot of the sample ring for the consumer. This never
+// waits for the consumer.
+static int _nrf_process_sample_block(nrf_device *device, const uint8_t *buffer, int length) {
     assert(length == NRF_BUFFER_SIZE_BYTES);
     if (device->receiving == 0) return 0;
 
-    pthread_mutex_lock(&device->data_mutex);
-    for (int i = 0; i < length; i += 2) {
-        uint8_t u8i = buffer[i];
-        uint8_t u8q = buffer[i + 1];
-        if (device->device_type == NRF_DEVICE_HACKRF || device->device_type == NRF_DEVICE_DUMMY) {
-            u8i = (u8i + 128) % 256;
-            u8q = (u8q + 128) % 256;
+    // Connected blocks may still hold on to the previous block.
+    if (NUT_ATOMIC_LOAD(&device->receive_store->refcount) != 1) {
+        nut_buffer_store_release(device->receive_store);
+        device->receive_store = nut_buffer_store_new(NRF_BUFFER_SIZE_BYTES);
+    }
+    uint8_t *samples = device->receive_store->data;
+    if (device->device_type == NRF_DEVICE_HACKRF || device->device_type == NRF_DEVICE_DUMMY) {
+        // Signed to offset binary, the format of RTL-SDR. Connect an
+        // nrf_iq_converter to get floats.
+        for (int i = 0; i < length; i++) {
+            samples[i] = buffer[i] ^ 0x80;
         }
-        device->samples[i] = u8i;
-        device->samples[i + 1] = u8q;
+    } else {
+        memcpy(samples, buffer, length);
     }
-    pthread_mutex_unlock(&device->data_mutex);
 
+    uint64_t seq = device->write_seq;
+    nrf_sample_block *slot = &device->ring[seq % NRF_RING_SLOTS];
+    NUT_ATOMIC_STORE_RELAXED(&slot->seq, NRF_SLOT_WRITING);
+    NUT_ATOMIC_FENCE_RELEASE();
+    memcpy(slot->samples, samples, length);
+    NUT_ATOMIC_STORE(&slot->seq, seq);
+    NUT_ATOMIC_STORE(&device->write_seq, seq + 1);
+
+    pthread_mutex_lock(&device->decode_mutex);
     if (device->decode_cb_fn != NULL) {
-        device->decode_cb_fn(device, device->decode_cb_ctx);
+        device->decode_cb_fn(device, samples, device->decode_cb_ctx);
     }
+    pthread_mutex_unlock(&device->decode_mutex);
 
     if (device->receiving == 0) return 0;
 
     nrf_block_process(&device->block, NULL);
 
-    // if (device->block.n_outputs > 0) {
-    //     nut_buffer *buffer = nrf_device_get_samples_buffer(device);
-    //     for (int i = 0; i < device->block.n_outputs; i++) {
-    //         if (device->receiving == 0) return 0;
-    //         nrf_block *output = device->block.outputs[i];
-    //         nrf_block_process(output, buffer);
-    //     }
-    //     nut_buffer_free(buffer);
-    // }
-
     return 0;
 }
 
@@ -150,21 +542,71 @@ static int _nrf_hackrf_receive_sample_block(hackrf_transfer *transfer) {
     return _nrf_process_sample_block(device, transfer->buffer, transfer->valid_length);
 }
 
-static void _nrf_advance_block(nrf_device *device) {
-    if (!device->paused) {
-        device->dummy_block_index++;
-        if (device->dummy_block_index >= device->dummy_block_length) {
-            device->dummy_block_index = 0;
-        }
+// Move to the next block, wrapping around at the end of the data file.
+// If the offset was changed by nrf_device_seek in the meantime, keep that.
+static void _nrf_dummy_advance(nrf_device *device) {
+    uint64_t offset = NUT_ATOMIC_LOAD(&device->dummy_offset);
+    uint64_t next_offset = offset + NRF_BUFFER_SIZE_BYTES;
+    if (next_offset >= device->dummy_size) {
+        next_offset = 0;
+    }
+    NUT_ATOMIC_COMPARE_EXCHANGE(&device->dummy_offset, &offset, next_offset);
+}
+
+// Return the block at the current offset. The data file is mapped, so this
+// doesn't copy, except for the last block if the file ends halfway through
+// it. That block is padded with zeroes.
+static const uint8_t *_nrf_dummy_read_block(nrf_device *device) {
+    uint64_t offset = NUT_ATOMIC_LOAD(&device->dummy_offset);
+    if (offset + NRF_BUFFER_SIZE_BYTES <= device->dummy_size) {
+        return device->dummy_data + offset;
+    }
+    uint64_t length = device->dummy_size - offset;
+    if (length > 0) {
+        memcpy(device->receive_buffer, device->dummy_data + offset, length);
+    }
+    memset(device->receive_buffer + length, 0, NRF_BUFFER_SIZE_BYTES - length);
+    return device->receive_buffer;
+}
+
+// If real-time replay falls this far behind, for example because a connected
+// block was slow, start a new schedule instead of trying to catch up.
+#define NRF_REPLAY_MAX_LAG_SECONDS 0.5
+
+// In free-run mode, wait until the consumer has made room in the ring. This
+// only applies to consumers that use nrf_device_next_samples_buffer; others
+// skip to the latest block anyway.
+static void _nrf_dummy_wait_for_reader(nrf_device *device) {
+    while (device->receiving && NUT_ATOMIC_LOAD(&device->wait_for_reader)) {
+        uint64_t unread = NUT_ATOMIC_LOAD(&device->write_seq) - NUT_ATOMIC_LOAD(&device->read_seq);
+        if (unread < NRF_RING_SLOTS - 1) return;
+        nut_sleep_milliseconds(1);
     }
 }
 
 static void *_nrf_dummy_receive_loop(nrf_device *device) {
+    double block_seconds = NRF_SAMPLES_LENGTH / (double) device->sample_rate / device->replay_speed;
+    double start_time = nut_time_seconds();
+    uint64_t block_count = 0;
     while (device->receiving) {
-        unsigned char *buffer = device->receive_buffer + (device->dummy_block_index * NRF_BUFFER_SIZE_BYTES);
-        _nrf_process_sample_block(device, buffer, NRF_BUFFER_SIZE_BYTES);
-        _nrf_advance_block(device);
-        nut_sleep_milliseconds(1000 / 60);
+        if (device->replay_pacing == NRF_REPLAY_REALTIME || device->paused) {
+            // Deadlines are counted from the start time, so sleeping too
+            // long for one block is made up for by the next.
+            double now = nut_time_seconds();
+            double due_time = start_time + block_count * block_seconds;
+            if (now - due_time > NRF_REPLAY_MAX_LAG_SECONDS) {
+                start_time = due_time = now;
+                block_count = 0;
+            }
+            nut_sleep_seconds(due_time - now);
+            block_count++;
+        } else {
+            _nrf_dummy_wait_for_reader(device);
+        }
+        _nrf_process_sample_block(device, _nrf_dummy_read_block(device), NRF_BUFFER_SIZE_BYTES);
+        if (!device->paused) {
+            _nrf_dummy_advance(device);
+        }
     }
     return NULL;
 }
@@ -253,27 +695,42 @@ static int _nrf_hackrf_start(nrf_device *device, double freq_mhz, int sample_rat
 
 static const int DUMMY_DEFAULT_SAMPLE_RATE = 5e6;
 
-static int _nrf_dummy_start(nrf_device *device, const char *data_file) {
+// Map the data file into memory. Pages are read in on demand, so even very
+// large files open immediately.
+static int _nrf_dummy_open(nrf_device *device, const char *data_file) {
+    int fd = open(data_file, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return -1;
+    }
+    void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        return -1;
+    }
+    posix_madvise(data, st.st_size, POSIX_MADV_SEQUENTIAL);
+    device->dummy_data = data;
+    device->dummy_size = st.st_size;
+    return 0;
+}
+
+static int _nrf_dummy_start(nrf_device *device, const char *data_file, int sample_rate, nrf_replay_pacing pacing, double speed) {
     device->device_type = NRF_DEVICE_DUMMY;
-    device->sample_rate = DUMMY_DEFAULT_SAMPLE_RATE;
+    device->sample_rate = sample_rate != 0 ? sample_rate : DUMMY_DEFAULT_SAMPLE_RATE;
+    device->replay_pacing = pacing;
+    device->replay_speed = speed > 0 ? speed : 1;
+    device->receive_buffer = calloc(NRF_BUFFER_SIZE_BYTES, sizeof(uint8_t));
+    device->dummy_offset = 0;
 
     fprintf(stderr, "WARN nrf_device_new: Couldn't open SDR device. Falling back on data file %s\n", data_file);
     if (data_file != NULL) {
-        FILE *fp = fopen(data_file, "rb");
-        if (fp != NULL) {
-            fseek(fp, 0L, SEEK_END);
-            long size = ftell(fp);
-            rewind(fp);
-            device->receive_buffer = calloc(size, sizeof(uint8_t));
-            device->dummy_block_length = size / NRF_BUFFER_SIZE_BYTES;
-            device->dummy_block_index = 0;
-            fread(device->receive_buffer, size, 1, fp);
-            fclose(fp);
-        } else {
+        int status = _nrf_dummy_open(device, data_file);
+        if (status != 0) {
             fprintf(stderr, "WARN nrf_device_new: Couldn't open %s. Using empty buffer.\n", data_file);
-            device->receive_buffer = calloc(NRF_BUFFER_SIZE_BYTES, sizeof(uint8_t));
-            device->dummy_block_length = 1;
-            device->dummy_block_index = 0;
         }
     }
 
@@ -283,6 +740,12 @@ static int _nrf_dummy_start(nrf_device *device, const char *data_file) {
     return 0;
 }
 
+// The result function for the device block. This runs on the receive thread,
+// so it shares the block being received instead of consuming the ring.
+static nut_buffer *_nrf_device_get_receive_buffer(nrf_device *device) {
+    return nut_buffer_new_with_store(NUT_BUFFER_U8, NRF_SAMPLES_LENGTH, 2, device->receive_store);
+}
+
 // Start receiving on the given frequency.
 // If the device could not be opened, use the raw contents of the data_file
 // instead.
@@ -301,16 +764,17 @@ nrf_device *nrf_device_new_with_config(const nrf_device_config config) {
 
     int status;
     nrf_device *device = calloc(1, sizeof(nrf_device));
-    nrf_block_init(&device->block, NRF_BLOCK_SOURCE, NULL, (nrf_block_result_fn) nrf_device_get_samples_buffer);
-    pthread_mutex_init(&device->data_mutex, NULL);
-    memset(device->samples, 0, NRF_BUFFER_SIZE_BYTES);
+    nrf_block_init(&device->block, NRF_BLOCK_SOURCE, NULL, (nrf_block_result_fn) _nrf_device_get_receive_buffer);
+    device->receive_store = nut_buffer_store_new(NRF_BUFFER_SIZE_BYTES);
+    device->samples_store = nut_buffer_store_new(NRF_BUFFER_SIZE_BYTES);
+    pthread_mutex_init(&device->decode_mutex, NULL);
 
     // Try to find a suitable hardware device, fall back to data file.
     status = _nrf_rtlsdr_start(device, freq_mhz, sample_rate);
     if (status != 0) {
         status = _nrf_hackrf_start(device, freq_mhz, sample_rate);
         if (status != 0) {
-            status = _nrf_dummy_start(device, data_file);
+            status = _nrf_dummy_start(device, data_file, sample_rate, config.replay_pacing, config.replay_speed);
             if (status != 0) {
                 fprintf(stderr, "ERROR nrf_device_new: Couldn't even start dummy device. Exiting.\n");
             }
@@ -333,9 +797,13 @@ double nrf_device_set_frequency(nrf_device *device, double freq_mhz) {
     return freq_mhz;
 }
 
+// Waits for a running handler to finish, so the old context can be freed
+// when this returns.
 void nrf_device_set_decode_handler(nrf_device *device, nrf_device_decode_cb_fn fn, void *ctx) {
+    pthread_mutex_lock(&device->decode_mutex);
     device->decode_cb_fn = fn;
     device->decode_cb_ctx = ctx;
+    pthread_mutex_unlock(&device->decode_mutex);
 }
 
 void nrf_device_set_paused(nrf_device *device, int paused) {
@@ -343,79 +811,360 @@ void nrf_device_set_paused(nrf_device *device, int paused) {
 }
 
 void nrf_device_step(nrf_device *device) {
-    device->dummy_block_index++;
-    if (device->dummy_block_index >= device->dummy_block_length) {
-        device->dummy_block_index = 0;
+    _nrf_dummy_advance(device);
+}
+
+// Continue from the given sample in the data file. A sample is one I/Q pair.
+// This only works for dummy devices.
+void nrf_device_seek(nrf_device *device, uint64_t sample_offset) {
+    uint64_t offset = sample_offset * 2;
+    if (offset >= device->dummy_size) {
+        offset = device->dummy_size > 0 ? (device->dummy_size - 1) & ~(uint64_t) 1 : 0;
+    }
+    NUT_ATOMIC_STORE(&device->dummy_offset, offset);
+}
+
+// Continue from the given time in the data file, in seconds.
+void nrf_device_seek_time(nrf_device *device, double seconds) {
+    seconds = seconds < 0 ? 0 : seconds;
+    nrf_device_seek(device, seconds * device->sample_rate);
+}
+
+// Copy the given block from the ring into the current samples. Returns 0 if
+// the block was overwritten by the receive thread before we could copy it.
+static int _nrf_device_read_block(nrf_device *device, uint64_t seq) {
+    nrf_sample_block *slot = &device->ring[seq % NRF_RING_SLOTS];
+    if (NUT_ATOMIC_LOAD(&slot->seq) != seq) return 0;
+    // Buffers handed out earlier keep the samples they were given.
+    if (NUT_ATOMIC_LOAD(&device->samples_store->refcount) != 1) {
+        nut_buffer_store_release(device->samples_store);
+        device->samples_store = nut_buffer_store_new(NRF_BUFFER_SIZE_BYTES);
+    }
+    memcpy(device->samples_store->data, slot->samples, NRF_BUFFER_SIZE_BYTES);
+    NUT_ATOMIC_FENCE_ACQUIRE();
+    if (NUT_ATOMIC_LOAD_RELAXED(&slot->seq) != seq) return 0;
+    device->samples_seq = seq;
+    NUT_ATOMIC_STORE(&device->read_seq, seq + 1);
+    return 1;
+}
+
+// Make the most recent block the current block, skipping older unread blocks.
+// If no new block has arrived, the current block stays the same.
+static void _nrf_device_read_latest(nrf_device *device) {
+    for (;;) {
+        uint64_t write_seq = NUT_ATOMIC_LOAD(&device->write_seq);
+        if (write_seq == device->read_seq) return;
+        uint64_t skipped = write_seq - 1 - device->read_seq;
+        if (_nrf_device_read_block(device, write_seq - 1)) {
+            device->skipped += skipped;
+            return;
+        }
     }
 }
 
+static nut_buffer *_nrf_device_samples_view(nrf_device *device) {
+    return nut_buffer_new_with_store(NUT_BUFFER_U8, NRF_SAMPLES_LENGTH, 2, device->samples_store);
+}
+
+// Return the most recent block of samples.
+// The buffer shares the samples with the device; it is not a copy.
 nut_buffer *nrf_device_get_samples_buffer(nrf_device *device) {
-    pthread_mutex_lock(&device->data_mutex);
-    nut_buffer *buffer = nut_buffer_new_u8(NRF_SAMPLES_LENGTH, 2, device->samples);
-    pthread_mutex_unlock(&device->data_mutex);
-    return buffer;
+    _nrf_device_read_latest(device);
+    return _nrf_device_samples_view(device);
+}
+
+// Return the oldest unread block of samples, or NULL if there is none.
+// Use this instead of nrf_device_get_samples_buffer to see every block.
+// Blocks that were overwritten before they could be read count as overruns.
+nut_buffer *nrf_device_next_samples_buffer(nrf_device *device) {
+    NUT_ATOMIC_STORE(&device->wait_for_reader, 1);
+    for (;;) {
+        uint64_t write_seq = NUT_ATOMIC_LOAD(&device->write_seq);
+        uint64_t seq = device->read_seq;
+        if (write_seq == seq) return NULL;
+        // The oldest slot may be being overwritten, so start after it.
+        if (write_seq - seq >= NRF_RING_SLOTS) {
+            uint64_t oldest_seq = write_seq - NRF_RING_SLOTS + 1;
+            device->overruns += oldest_seq - seq;
+            seq = oldest_seq;
+        }
+        if (_nrf_device_read_block(device, seq)) break;
+        device->overruns++;
+        NUT_ATOMIC_STORE(&device->read_seq, seq + 1);
+    }
+    return _nrf_device_samples_view(device);
+}
+
+nrf_device_stats nrf_device_get_stats(nrf_device *device) {
+    nrf_device_stats stats;
+    stats.received = NUT_ATOMIC_LOAD(&device->write_seq);
+    stats.overruns = device->overruns;
+    stats.skipped = device->skipped;
+    stats.seq = device->samples_seq;
+    return stats;
 }
 
 nut_buffer *nrf_device_get_iq_buffer(nrf_device *device) {
-    pthread_mutex_lock(&device->data_mutex);
+    _nrf_device_read_latest(device);
+    const uint8_t *samples = device->samples_store->data;
     nut_buffer *buffer = nut_buffer_new_u8(NRF_IQ_RESOLUTION * NRF_IQ_RESOLUTION, 1, NULL);
     for (int i = 0; i < NRF_BUFFER_SIZE_BYTES; i += 2) {
-        int u8i = device->samples[i];
-        int u8q = device->samples[i + 1];
+        int u8i = samples[i];
+        int u8q = samples[i + 1];
         int offset = u8i * 256 + u8q;
-        buffer->data.u8[offset]++;
+        buffer->data.u8[offset] += buffer->data.u8[offset] < 255;
     }
-    pthread_mutex_unlock(&device->data_mutex);
     return buffer;
 }
 
-static void pixel_inc(nut_buffer *image_buffer, int stride, int x, int y) {
-    int offset = y * stride + x;
-    if (image_buffer->type == NUT_BUFFER_U8) {
-        int v = image_buffer->data.u8[offset];
-        if (v < 255) {
-            image_buffer->data.u8[offset]++;
+// IQ line rasterizer. The segments are split over worker threads. Each
+// worker draws its share into its own image, and the images are added up
+// at the end. Pixels saturate at 255, and adding saturated images gives the
+// same result as drawing everything into one. The workers are started once
+// and keep their image, which grows to the largest image drawn.
+
+static void _nrf_add_saturate_u8(uint8_t *restrict dst, const uint8_t *restrict src, int length) {
+    int i = 0;
+#ifdef __SSE2__
+    for (; i + 16 <= length; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *) (dst + i));
+        __m128i b = _mm_loadu_si128((const __m128i *) (src + i));
+        _mm_storeu_si128((__m128i *) (dst + i), _mm_adds_epu8(a, b));
+    }
+#endif
+    for (; i < length; i++) {
+        int v = dst[i] + src[i];
+        dst[i] = v > 255 ? 255 : v;
+    }
+}
+
+static void _nrf_add_f32(float *restrict dst, const float *restrict src, int length) {
+    for (int i = 0; i < length; i++) {
+        dst[i] += src[i];
+    }
+}
+
+// Bresenham's line, including both end points.
+static void _nrf_draw_line_u8(uint8_t *image, int stride, int x1, int y1, int x2, int y2) {
+    int dx = abs(x2 - x1);
+    int sx = x1 < x2 ? 1 : -1;
+    int dy = abs(y2 - y1);
+    int sy = y1 < y2 ? 1 : -1;
+    int err = (dx > dy ? dx : -dy) / 2;
+    for (;;) {
+        uint8_t *pixel = image + y1 * stride + x1;
+        *pixel += *pixel < 255;
+        if (x1 == x2 && y1 == y2) break;
+        int e2 = err;
+        if (e2 > -dx) { err -= dy; x1 += sx; }
+        if (e2 < dy) { err += dx; y1 += sy; }
+    }
+}
+
+// Wu's antialiased line: every step along the major axis adds 1, split
+// over the two pixels closest to the line.
+static void _nrf_draw_line_f32(float *image, int size, float x1, float y1, float x2, float y2) {
+    int steep = fabsf(y2 - y1) > fabsf(x2 - x1);
+    float a1 = steep ? y1 : x1;
+    float b1 = steep ? x1 : y1;
+    float a2 = steep ? y2 : x2;
+    float b2 = steep ? x2 : y2;
+    if (a1 > a2) {
+        float t = a1; a1 = a2; a2 = t;
+        t = b1; b1 = b2; b2 = t;
+    }
+    float gradient = a2 - a1 > 0 ? (b2 - b1) / (a2 - a1) : 0;
+    int start = (int) roundf(a1);
+    int end = (int) roundf(a2);
+    for (int a = start; a <= end; a++) {
+        // Rounding the end points can take b just outside the image.
+        float b = b1 + gradient * (a - a1);
+        b = b < 0 ? 0 : b > size - 1 ? size - 1 : b;
+        int b0 = (int) b;
+        float frac = b - b0;
+        int bn = b0 + 1 < size ? b0 + 1 : b0;
+        if (steep) {
+            image[a * size + b0] += 1 - frac;
+            image[a * size + bn] += frac;
+        } else {
+            image[b0 * size + a] += 1 - frac;
+            image[bn * size + a] += frac;
+        }
+    }
+}
+
+typedef struct {
+    // x, y pairs, in pixels
+    const float *points;
+    // Draws the segments from point i to i + 1, for start <= i < end.
+    int start;
+    int end;
+    int size;
+    int antialias;
+    void *image;
+} _nrf_iq_lines_job;
+
+static void *_nrf_iq_lines_worker(_nrf_iq_lines_job *job) {
+    const float *p = job->points;
+    for (int i = job->start; i < job->end; i++) {
+        if (job->antialias) {
+            _nrf_draw_line_f32(job->image, job->size, p[i * 2], p[i * 2 + 1], p[i * 2 + 2], p[i * 2 + 3]);
+        } else {
+            _nrf_draw_line_u8(job->image, job->size, p[i * 2], p[i * 2 + 1], p[i * 2 + 2], p[i * 2 + 3]);
+        }
+    }
+    return NULL;
+}
+
+typedef struct {
+    // Held for a whole drawing, so only one drawing uses the workers.
+    pthread_mutex_t draw_mutex;
+    pthread_mutex_t mutex;
+    pthread_cond_t start_cond;
+    pthread_cond_t done_cond;
+    int n_workers;
+    // Incremented for every drawing. Worker t draws jobs[t] if t < n_jobs.
+    unsigned generation;
+    // The generation worker t has seen.
+    unsigned seen[NRF_IQ_LINES_MAX_THREADS];
+    int n_jobs;
+    int pending;
+    _nrf_iq_lines_job jobs[NRF_IQ_LINES_MAX_THREADS];
+    void *images[NRF_IQ_LINES_MAX_THREADS];
+    size_t image_sizes[NRF_IQ_LINES_MAX_THREADS];
+} _nrf_iq_lines_pool;
+
+static _nrf_iq_lines_pool _nrf_iq_lines = {
+    PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER
+};
+
+static void *_nrf_iq_lines_pool_worker(void *arg) {
+    _nrf_iq_lines_pool *pool = &_nrf_iq_lines;
+    int t = (int) (intptr_t) arg;
+    pthread_mutex_lock(&pool->mutex);
+    for (;;) {
+        while (pool->generation == pool->seen[t]) {
+            pthread_cond_wait(&pool->start_cond, &pool->mutex);
+        }
+        pool->seen[t] = pool->generation;
+        if (t >= pool->n_jobs) continue;
+        pthread_mutex_unlock(&pool->mutex);
+        _nrf_iq_lines_job *job = &pool->jobs[t];
+        size_t pixel_size = job->antialias ? sizeof(float) : sizeof(uint8_t);
+        memset(job->image, 0, job->size * job->size * pixel_size);
+        _nrf_iq_lines_worker(job);
+        pthread_mutex_lock(&pool->mutex);
+        if (--pool->pending == 0) {
+            pthread_cond_signal(&pool->done_cond);
         }
-    } else {
-        image_buffer->data.f64[offset]++;
     }
+    return NULL;
 }
 
-static void draw_line(nut_buffer *image_buffer, int stride, int x1, int y1, int x2, int y2, int color) {
-  int dx = abs(x2 - x1);
-  int sx = x1 < x2 ? 1 : -1;
-  int dy = abs(y2-y1);
-  int sy = y1 < y2 ? 1 : -1;
-  int err = (dx > dy ? dx : -dy) / 2;
-  int e2;
+// Returns a size x size image, u8 or with antialiasing f32.
+static nut_buffer *_nrf_draw_iq_lines(const float *points, int n_points, int size, int antialias) {
+    nut_buffer *image_buffer = antialias ? nut_buffer_new_f32(size * size, 1, NULL) : nut_buffer_new_u8(size * size, 1, NULL);
+    int n_segments = n_points - 1;
+    if (n_segments <= 0) return image_buffer;
+
+    int n_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    n_threads = n_threads < NRF_IQ_LINES_MAX_THREADS ? n_threads : NRF_IQ_LINES_MAX_THREADS;
+    n_threads = n_threads < n_segments / NRF_IQ_LINES_MIN_SEGMENTS ? n_threads : n_segments / NRF_IQ_LINES_MIN_SEGMENTS;
+    n_threads = n_threads > 1 ? n_threads : 1;
+
+    _nrf_iq_lines_pool *pool = &_nrf_iq_lines;
+    pthread_mutex_lock(&pool->draw_mutex);
+    size_t image_size = size * size * (antialias ? sizeof(float) : sizeof(uint8_t));
+    for (int t = 0; t < n_threads; t++) {
+        _nrf_iq_lines_job *job = &pool->jobs[t];
+        job->points = points;
+        job->start = (int64_t) n_segments * t / n_threads;
+        job->end = (int64_t) n_segments * (t + 1) / n_threads;
+        job->size = size;
+        job->antialias = antialias;
+        // The calling thread draws into the result.
+        if (t == 0) {
+            job->image = image_buffer->data.u8;
+            continue;
+        }
+        if (pool->image_sizes[t] < image_size) {
+            free(pool->images[t]);
+            pool->images[t] = malloc(image_size);
+            pool->image_sizes[t] = image_size;
+        }
+        job->image = pool->images[t];
+        if (t > pool->n_workers) {
+            pthread_t thread;
+            pool->seen[t] = pool->generation;
+            pthread_create(&thread, NULL, _nrf_iq_lines_pool_worker, (void *) (intptr_t) t);
+            pthread_detach(thread);
+            pool->n_workers = t;
+        }
+    }
+    if (n_threads > 1) {
+        pthread_mutex_lock(&pool->mutex);
+        pool->n_jobs = n_threads;
+        pool->pending = n_threads - 1;
+        pool->generation++;
+        pthread_cond_broadcast(&pool->start_cond);
+        pthread_mutex_unlock(&pool->mutex);
+    }
+    _nrf_iq_lines_worker(&pool->jobs[0]);
+    if (n_threads > 1) {
+        pthread_mutex_lock(&pool->mutex);
+        while (pool->pending > 0) {
+            pthread_cond_wait(&pool->done_cond, &pool->mutex);
+        }
+        pthread_mutex_unlock(&pool->mutex);
+    }
+    for (int t = 1; t < n_threads; t++) {
+        if (antialias) {
+            _nrf_add_f32(image_buffer->data.f32, pool->jobs[t].image, size * size);
+        } else {
+            _nrf_add_saturate_u8(image_buffer->data.u8, pool->jobs[t].image, size * size);
+        }
+    }
+    pthread_mutex_unlock(&pool->draw_mutex);
+    return image_buffer;
+}
 
-  for(;;){
-    pixel_inc(image_buffer, stride, x1, y1);
-    if (x1 == x2 && y1 == y2) break;
-    e2 = err;
-    if (e2 > -dx) { err -= dy; x1 += sx; }
-    if (e2 <  dy) { err += dx; y1 += sy; }
-  }
+// Converts the first n_points I/Q pairs to pixels. U8 values are scaled by
+// the size multiplier; other types keep their fraction when antialiasing.
+// Complex values from -1 to 1 cover the image, other values from 0 to 1.
+static float *_nrf_iq_lines_points(nut_buffer *buffer, int n_points, int size_multiplier, int antialias) {
+    float *points = malloc(n_points * 2 * sizeof(float));
+    float max = NRF_IQ_RESOLUTION * size_multiplier - 1;
+    if (buffer->type == NUT_BUFFER_U8) {
+        for (int i = 0; i < n_points * 2; i++) {
+            points[i] = buffer->data.u8[i] * size_multiplier;
+        }
+    } else {
+        // Complex buffers are centered around 0, as in nrf_iq_density_process.
+        const float scale = buffer->type == NUT_BUFFER_CF32 ? NRF_IQ_RESOLUTION * 0.5f : NRF_IQ_RESOLUTION;
+        const float offset = buffer->type == NUT_BUFFER_CF32 ? NRF_IQ_RESOLUTION * 0.5f : 0;
+        nut_buffer_read_f32(buffer, 0, n_points * 2, points);
+        for (int i = 0; i < n_points * 2; i++) {
+            float v = points[i] * scale + offset;
+            v = v < 0 ? 0 : v > NRF_IQ_RESOLUTION - 1 ? NRF_IQ_RESOLUTION - 1 : v;
+            v = antialias ? v : floorf(v);
+            v *= size_multiplier;
+            points[i] = v < max ? v : max;
+        }
+    }
+    return points;
 }
 
+// The samples are copied out of the ring first, so the receive thread can
+// keep writing while we draw.
 nut_buffer *nrf_device_get_iq_lines(nrf_device *device, int size_multiplier, float line_percentage) {
     line_percentage = _nrf_clampf(line_percentage, 0, 1);
-    pthread_mutex_lock(&device->data_mutex);
-    int sz = NRF_IQ_RESOLUTION * size_multiplier;
-    nut_buffer *image_buffer = nut_buffer_new_u8(sz * sz, 1, NULL);
-    int x1 = 0;
-    int y1 = 0;
-    int max = NRF_BUFFER_SIZE_BYTES * line_percentage;
-    for (int i = 0; i < max; i += 2) {
-        int x2 = device->samples[i] * size_multiplier;
-        int y2 = device->samples[i + 1] * size_multiplier;
-        if (i > 0) {
-            draw_line(image_buffer, NRF_IQ_RESOLUTION * size_multiplier, x1, y1, x2, y2, 0);
-        }
-        x1 = x2;
-        y1 = y2;
-    }
-    pthread_mutex_unlock(&device->data_mutex);
+    _nrf_device_read_latest(device);
+    nut_buffer *samples = _nrf_device_samples_view(device);
+    int n_points = ((int) (NRF_BUFFER_SIZE_BYTES * line_percentage) + 1) / 2;
+    float *points = _nrf_iq_lines_points(samples, n_points, size_multiplier, 0);
+    nut_buffer *image_buffer = _nrf_draw_iq_lines(points, n_points, NRF_IQ_RESOLUTION * size_multiplier, 0);
+    free(points);
+    nut_buffer_release(samples);
     return image_buffer;
 }
 
@@ -433,9 +1182,16 @@ void nrf_device_free(nrf_device *device) {
         device->receiving = 0;
         pthread_join(device->receive_thread, NULL);
     }
+    nrf_block_deinit(&device->block);
     if (device->receive_buffer) {
         free(device->receive_buffer);
     }
+    if (device->dummy_data) {
+        munmap((void *) device->dummy_data, device->dummy_size);
+    }
+    nut_buffer_store_release(device->receive_store);
+    nut_buffer_store_release(device->samples_store);
+    pthread_mutex_destroy(&device->decode_mutex);
     free(device);
 }
 
@@ -443,6 +1199,7 @@ void nrf_device_free(nrf_device *device) {
 
 nrf_interpolator *nrf_interpolator_new(double interpolate_step) {
     nrf_interpolator *interpolator = calloc(1, sizeof(nrf_interpolator));
+    nrf_block_init(&interpolator->block, NRF_BLOCK_GENERIC, (nrf_block_process_fn) nrf_interpolator_process, (nrf_block_result_fn) nrf_interpolator_get_buffer);
     interpolator->interpolate_step = interpolate_step;
     interpolator->t = -1;
     return interpolator;
@@ -451,11 +1208,7 @@ nrf_interpolator *nrf_interpolator_new(double interpolate_step) {
 void nrf_interpolator_process(nrf_interpolator *interpolator, nut_buffer *buffer) {
     if (interpolator->t < 0.0) {
         // Special start-up condition. Set b_buffer and interpolate from zero.
-        if (buffer->type == NUT_BUFFER_U8) {
-            interpolator->buffer_a = nut_buffer_new_u8(buffer->length, buffer->channels, NULL);
-        } else {
-            interpolator->buffer_a = nut_buffer_new_f64(buffer->length, buffer->channels, NULL);
-        }
+        interpolator->buffer_a = nut_buffer_new(buffer->type, buffer->length, buffer->channels, NULL);
         interpolator->buffer_b = nut_buffer_copy(buffer);
         interpolator->t = 0.0;
     } else if (interpolator->t >= 1.0) {
@@ -473,12 +1226,7 @@ nut_buffer *nrf_interpolator_get_buffer(nrf_interpolator *interpolator) {
     double t = interpolator->t;
     assert(a->type == b->type);
     assert(a->size_bytes == b->size_bytes);
-    nut_buffer *dst;
-    if (a->type == NUT_BUFFER_U8) {
-        dst = nut_buffer_new_u8(a->length, a->channels, NULL);
-    } else {
-        dst = nut_buffer_new_f64(a->length, a->channels, NULL);
-    }
+    nut_buffer *dst = nut_buffer_new(a->type, a->length, a->channels, NULL);
     int size = a->length * a->channels;
     for (int i = 0; i < size; i++) {
         double va = nut_buffer_get_f64(a, i);
@@ -490,8 +1238,9 @@ nut_buffer *nrf_interpolator_get_buffer(nrf_interpolator *interpolator) {
 }
 
 void nrf_interpolator_free(nrf_interpolator *interpolator) {
-    nut_buffer_free(interpolator->buffer_a);
-    nut_buffer_free(interpolator->buffer_b);
+    nrf_block_deinit(&interpolator->block);
+    nut_buffer_release(interpolator->buffer_a);
+    nut_buffer_release(interpolator->buffer_b);
     free(interpolator);
 }
 
@@ -499,12 +1248,9 @@ void nrf_interpolator_free(nrf_interpolator *interpolator) {
 
 // Take a buffer with 2 channels and a channel for "t", the position.
 nut_buffer *nrf_buffer_add_position_channel(nut_buffer *buffer) {
-    nut_buffer *result;
-    if (buffer->type == NUT_BUFFER_U8) {
-        result = nut_buffer_new_u8(buffer->length, buffer->channels + 1, NULL);
-    } else {
-        result = nut_buffer_new_f64(buffer->length, buffer->channels + 1, NULL);
-    }
+    // With the extra channel the values are no longer complex pairs.
+    nut_buffer_type type = buffer->type == NUT_BUFFER_CF32 ? NUT_BUFFER_F32 : buffer->type;
+    nut_buffer *result = nut_buffer_new(type, buffer->length, buffer->channels + 1, NULL);
     int size = buffer->length * buffer->channels;
     int k = 0;
     for (int i = 0; i < size; i += buffer->channels) {
@@ -526,158 +1272,600 @@ nut_buffer *nrf_buffer_to_iq_points(nut_buffer *buffer) {
         int u8i = nut_buffer_get_u8(buffer, i);
         int u8q = nut_buffer_get_u8(buffer, i + 1);
         int offset = u8i * NRF_IQ_RESOLUTION + u8q;
-        img->data.u8[offset]++;
+        img->data.u8[offset] += img->data.u8[offset] < 255;
     }
     return img;
 }
 
 // Convert a buffer to I/Q lines.
-nut_buffer *nrf_buffer_to_iq_lines(nut_buffer *buffer, int size_multiplier, float line_percentage) {
+static nut_buffer *_nrf_buffer_to_iq_lines(nut_buffer *buffer, int size_multiplier, float line_percentage, int antialias) {
     line_percentage = _nrf_clampf(line_percentage, 0, 1);
-    int sz = NRF_IQ_RESOLUTION * size_multiplier;
-    nut_buffer *image_buffer = nut_buffer_new_u8(sz * sz, 1, NULL);
-    int x1 = 0;
-    int y1 = 0;
     int size = buffer->length * buffer->channels;
-    int max = size * line_percentage;
-    for (int i = 0; i < max; i += 2) {
-        int x2 = nut_buffer_get_u8(buffer, i) * size_multiplier;
-        int y2 = nut_buffer_get_u8(buffer, i + 1) * size_multiplier;
-        if (i > 0) {
-            draw_line(image_buffer, NRF_IQ_RESOLUTION * size_multiplier, x1, y1, x2, y2, 0);
-        }
-        x1 = x2;
-        y1 = y2;
-    }
+    int n_points = ((int) (size * line_percentage) + 1) / 2;
+    float *points = _nrf_iq_lines_points(buffer, n_points, size_multiplier, antialias);
+    nut_buffer *image_buffer = _nrf_draw_iq_lines(points, n_points, NRF_IQ_RESOLUTION * size_multiplier, antialias);
+    free(points);
     return image_buffer;
 }
 
-// FFT Analysis
+nut_buffer *nrf_buffer_to_iq_lines(nut_buffer *buffer, int size_multiplier, float line_percentage) {
+    return _nrf_buffer_to_iq_lines(buffer, size_multiplier, line_percentage, 0);
+}
 
-nrf_fft *nrf_fft_new(int fft_size, int fft_history_size) {
-    nrf_fft *fft = calloc(1, sizeof(nrf_fft));
-    nrf_block_init(&fft->block, NRF_BLOCK_GENERIC, (nrf_block_process_fn) nrf_fft_process, (nrf_block_result_fn) nrf_fft_get_buffer);
-    fft->fft_size = fft_size;
-    fft->fft_history_size = fft_history_size;
-    fft->fft_in = (fftw_complex*) fftw_malloc(sizeof(fftw_complex) * NRF_SAMPLES_LENGTH);
-    fft->fft_out = (fftw_complex*) fftw_malloc(sizeof(fftw_complex) * NRF_SAMPLES_LENGTH);
-    fft->fft_plan = fftw_plan_dft_1d(fft_size, fft->fft_in, fft->fft_out, FFTW_FORWARD, FFTW_MEASURE);
-    fft->buffer = calloc(fft_size * fft_history_size, sizeof(double));
-    return fft;
+// Like nrf_buffer_to_iq_lines, but returns a float image of antialiased
+// lines. Pixels don't saturate, so this shows the density of the lines.
+nut_buffer *nrf_buffer_to_iq_lines_antialiased(nut_buffer *buffer, int size_multiplier, float line_percentage) {
+    return _nrf_buffer_to_iq_lines(buffer, size_multiplier, line_percentage, 1);
 }
 
-void nrf_fft_shift(nrf_fft *fft, double d) {
-    int shift_pixels = round(fft->fft_size / d);
-    if (shift_pixels == 0) {
-        // Don't do anything.
-    } else if (abs(shift_pixels) >= fft->fft_size) {
-        // If we shifted so far that we're out of the range, start over.
-        memset(fft->buffer, 0, fft->fft_size * fft->fft_history_size * sizeof(double));
+// IQ Density
+
+// Above this weight, the density is scaled back to a weight of 1.
+#define NRF_IQ_DENSITY_MAX_WEIGHT 1e18
+#define NRF_IQ_DENSITY_CHUNK 1024
+
+nrf_iq_density *nrf_iq_density_new(nrf_iq_density_config config) {
+    nrf_iq_density *density = calloc(1, sizeof(nrf_iq_density));
+    nrf_block_init(&density->block, NRF_BLOCK_GENERIC, (nrf_block_process_fn) nrf_iq_density_process, (nrf_block_result_fn) nrf_iq_density_get_buffer);
+    if (config.resolution <= 0) {
+        config.resolution = NRF_IQ_RESOLUTION;
+    }
+    if (config.decay <= 0 || config.decay > 1) {
+        config.decay = NRF_IQ_DENSITY_DEFAULT_DECAY;
+    }
+    if (config.gain <= 0) {
+        config.gain = 1;
+    }
+    density->config = config;
+    density->density = calloc(config.resolution * config.resolution, sizeof(float));
+    density->weight = 1;
+    pthread_mutex_init(&density->density_mutex, NULL);
+    return density;
+}
+
+static void _nrf_scale_f32(float *restrict values, int length, float scale) {
+    for (int i = 0; i < length; i++) {
+        values[i] *= scale;
+    }
+}
+
+// Adds the I/Q points of the buffer, I vertically and Q horizontally. Like
+// nrf_buffer_to_iq_points, values from 0 to 1 cover the image, except for
+// complex buffers, which are centered around 0 like the IQ converter output.
+void nrf_iq_density_process(nrf_iq_density *density, nut_buffer *buffer) {
+    assert(buffer->channels == 2);
+    const int res = density->config.resolution;
+    pthread_mutex_lock(&density->density_mutex);
+    density->weight /= density->config.decay;
+    if (density->weight > NRF_IQ_DENSITY_MAX_WEIGHT) {
+        _nrf_scale_f32(density->density, res * res, 1 / density->weight);
+        density->weight = 1;
+    }
+    const float weight = density->weight;
+    float *cells = density->density;
+    if (buffer->type == NUT_BUFFER_U8) {
+        const uint8_t *samples = buffer->data.u8;
+        for (int i = 0; i < buffer->length; i++) {
+            int x = samples[i * 2] * res >> 8;
+            int y = samples[i * 2 + 1] * res >> 8;
+            cells[x * res + y] += weight;
+        }
     } else {
-        int stride = fft->fft_size;
-        for (int y = 0; y < fft->fft_history_size; y++) {
-            if (shift_pixels > 0) {
-                for (int x = 0; x < fft->fft_size - shift_pixels; x++) {
-                    fft->buffer[y * stride + x] = fft->buffer[y * stride + x + shift_pixels];
-                }
-                for (int x = fft->fft_size - shift_pixels; x < fft->fft_size; x++) {
-                    fft->buffer[y * stride + x] = 0;
-                }
-            } else {
-                for (int x = fft->fft_size - 1; x >= -shift_pixels; x--) {
-                    fft->buffer[y * stride + x] = fft->buffer[y * stride + x + shift_pixels];
-                }
-                for (int x = 0; x < -shift_pixels; x++) {
-                    fft->buffer[y * stride + x] = 0;
-                }
+        float values[NRF_IQ_DENSITY_CHUNK];
+        const float scale = buffer->type == NUT_BUFFER_CF32 ? res * 0.5f : res;
+        const float offset = buffer->type == NUT_BUFFER_CF32 ? res * 0.5f : 0;
+        int size = buffer->length * 2;
+        for (int start = 0; start < size; start += NRF_IQ_DENSITY_CHUNK) {
+            int n = size - start < NRF_IQ_DENSITY_CHUNK ? size - start : NRF_IQ_DENSITY_CHUNK;
+            nut_buffer_read_f32(buffer, start, n, values);
+            for (int i = 0; i < n; i += 2) {
+                float vx = values[i] * scale + offset;
+                float vy = values[i + 1] * scale + offset;
+                int x = vx < 0 ? 0 : vx > res - 1 ? res - 1 : (int) vx;
+                int y = vy < 0 ? 0 : vy > res - 1 ? res - 1 : (int) vy;
+                cells[x * res + y] += weight;
             }
         }
     }
-}
-
-void nrf_fft_process(nrf_fft *fft, nut_buffer *buffer) {
-    int size = buffer->length * buffer->channels;
-    int ii = 0;
-    for (int i = 0; i < size; i += 2) {
-        fftw_complex *p = fft->fft_in;
-        double di, dq;
-        if (buffer->type == NUT_BUFFER_U8) {
-            di = buffer->data.u8[i] / 256.0;
-            dq = buffer->data.u8[i + 1] / 256.0;
-        } else {
-            di = buffer->data.f64[i];
-            dq = buffer->data.f64[i + 1];
-        }
-        p[ii][0] = powf(-1, ii) * di;
-        p[ii][1] = powf(-1, ii) * dq;
-        ii++;
-    }
-    fftw_execute(fft->fft_plan);
-    // Move the previous lines down
-    memcpy(fft->buffer + fft->fft_size, fft->buffer, fft->fft_size * (fft->fft_history_size - 1) * sizeof(double));
-    // Set the first line
-    for (int i = 0; i < fft->fft_size; i++) {
-        // DC compensation
-        if (i == fft->fft_size / 2) {
-            fft->buffer[i] = fft->buffer[i - 1];
-        } else {
-            fftw_complex *out = fft->fft_out;
-            double fi = out[i][0];
-            double fq = out[i][1];
-            double pwr = sqrt(fi * fi + fq * fq);
-            fft->buffer[i] = pwr;
+    pthread_mutex_unlock(&density->density_mutex);
+}
+
+void nrf_iq_density_clear(nrf_iq_density *density) {
+    const int res = density->config.resolution;
+    pthread_mutex_lock(&density->density_mutex);
+    memset(density->density, 0, res * res * sizeof(float));
+    density->weight = 1;
+    pthread_mutex_unlock(&density->density_mutex);
+}
+
+// Returns the density as a resolution x resolution u8 image. The image is
+// reused if the caller let go of the last one.
+nut_buffer *nrf_iq_density_get_buffer(nrf_iq_density *density) {
+    const int res = density->config.resolution;
+    const int size = res * res;
+    pthread_mutex_lock(&density->density_mutex);
+    if (density->image != NULL && !nut_buffer_is_writable(density->image)) {
+        nut_buffer_release(density->image);
+        density->image = NULL;
+    }
+    if (density->image == NULL) {
+        density->image = nut_buffer_new_u8(size, 1, NULL);
+    }
+    uint8_t *restrict out = density->image->data.u8;
+    const float *restrict cells = density->density;
+    if (density->config.scale == NRF_IQ_DENSITY_LOG) {
+        float peak = 0;
+        for (int i = 0; i < size; i++) {
+            peak = cells[i] > peak ? cells[i] : peak;
+        }
+        // log(1 + d) with d in hits, so single hits still show.
+        float to_hits = 1 / density->weight;
+        float scale = peak > 0 ? 255 / log1pf(peak * to_hits) : 0;
+        for (int i = 0; i < size; i++) {
+            out[i] = log1pf(cells[i] * to_hits) * scale;
+        }
+    } else {
+        float scale = density->config.gain / density->weight;
+        for (int i = 0; i < size; i++) {
+            float v = cells[i] * scale;
+            out[i] = v < 255 ? v : 255;
         }
     }
+    nut_buffer *image = nut_buffer_copy(density->image);
+    pthread_mutex_unlock(&density->density_mutex);
+    return image;
 }
 
-nut_buffer *nrf_fft_get_buffer(nrf_fft *fft) {
-    return nut_buffer_new_f64(fft->fft_size * fft->fft_history_size, 1, (double *) fft->buffer);
+void nrf_iq_density_free(nrf_iq_density *density) {
+    nrf_block_deinit(&density->block);
+    pthread_mutex_destroy(&density->density_mutex);
+    if (density->image != NULL) {
+        nut_buffer_release(density->image);
+    }
+    free(density->density);
+    free(density);
 }
 
-void nrf_fft_free(nrf_fft *fft) {
-    fftw_destroy_plan(fft->fft_plan);
-    fftw_free(fft->fft_in);
-    fftw_free(fft->fft_out);
-    free(fft);
-}
+// FFT Analysis
 
-// Finite Impulse Response (FIR) Filter
+// FFTW planning isn't thread-safe, and the wisdom only needs to be loaded
+// once per process.
+static pthread_mutex_t _nrf_fftw_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int _nrf_fftw_initialized = 0;
 
-// Generates coefficients for a FIR low-pass filter with the given
-// half-amplitude frequency and kernel length at the given sample rate.
-//
-// sample_rate    - The signal's sample rate.
-// half_ampl_freq - The half-amplitude frequency in Hz.
-// length         - The filter kernel's length. Should be an odd number.
-//
-// Returns the FIR coefficients for the filter.
-double *nrf_fir_get_low_pass_coefficients(int sample_rate, int half_ampl_freq, int length) {
-    length += (length + 1) % 2;
-    double freq = half_ampl_freq / (double) sample_rate;
-    double *coefs = calloc(length, sizeof(double));
-    int center = floor(length / 2);
-    double sum = 0;
-    for (int i = 0; i < length; i++) {
-        double val;
-        if (i == center) {
-            val = TAU * freq;
-        } else {
-            double angle = TAU * (i + 1) / (double) (length + 1);
-            val = sin(TAU * freq * (i - center)) / (double) (i - center);
-            val *= 0.42 - 0.5 * cos(angle) + 0.08 * cos(2 * angle);
+static int _nrf_fftw_wisdom_path(const char *wisdom_file, char *path, size_t size) {
+    if (wisdom_file != NULL) {
+        snprintf(path, size, "%s", wisdom_file);
+        return 1;
+    }
+    const char *home = getenv("HOME");
+    if (home == NULL) return 0;
+    snprintf(path, size, "%s/.frequensea-fftw-wisdom", home);
+    return 1;
+}
+
+// Plan `howmany` FFTs of size n, stored one after another. The sign is
+// FFTW_FORWARD or FFTW_BACKWARD (inverse, not normalized). Plans are
+// measured once and then cached in the wisdom file, so planning is instant
+// on later runs.
+static fftwf_plan _nrf_fftw_plan(int n, int howmany, fftwf_complex *in, fftwf_complex *out, int sign, int threads, const char *wisdom_file) {
+    char path[1024];
+    int has_wisdom = _nrf_fftw_wisdom_path(wisdom_file, path, sizeof(path));
+
+    pthread_mutex_lock(&_nrf_fftw_mutex);
+    if (!_nrf_fftw_initialized) {
+#ifdef NRF_FFTW_THREADS
+        fftwf_init_threads();
+#endif
+        if (has_wisdom) {
+            fftwf_import_wisdom_from_filename(path);
         }
-        sum += val;
-        coefs[i] = val;
+        _nrf_fftw_initialized = 1;
     }
-    for (int i = 0; i < length; i++) {
-        coefs[i] /= sum;
+#ifdef NRF_FFTW_THREADS
+    if (threads <= 0) {
+        threads = n * howmany >= NRF_FFT_THREADS_MIN_SIZE ? sysconf(_SC_NPROCESSORS_ONLN) : 1;
     }
-    return coefs;
+    fftwf_plan_with_nthreads(threads > 0 ? threads : 1);
+#endif
+    fftwf_plan plan = fftwf_plan_many_dft(1, &n, howmany, in, NULL, 1, n, out, NULL, 1, n, sign, FFTW_MEASURE);
+    if (has_wisdom) {
+        fftwf_export_wisdom_to_filename(path);
+    }
+    pthread_mutex_unlock(&_nrf_fftw_mutex);
+    return plan;
 }
 
-nrf_fir_filter *nrf_fir_filter_new(int sample_rate, int half_ampl_freq, int length) {
-    nrf_fir_filter *filter = calloc(1, sizeof(nrf_fir_filter));
-    filter->length = length;
+// Destroying a plan changes the planner state as well, so it needs the lock.
+static void _nrf_fftw_destroy_plan(fftwf_plan plan) {
+    pthread_mutex_lock(&_nrf_fftw_mutex);
+    fftwf_destroy_plan(plan);
+    pthread_mutex_unlock(&_nrf_fftw_mutex);
+}
+
+static double _nrf_window_value(nrf_window_type type, int i, int size) {
+    double x = TAU * i / (double) size;
+    if (type == NRF_WINDOW_HANN) {
+        return 0.5 - 0.5 * cos(x);
+    } else if (type == NRF_WINDOW_BLACKMAN_HARRIS) {
+        return 0.35875 - 0.48829 * cos(x) + 0.14128 * cos(2 * x) - 0.01168 * cos(3 * x);
+    } else if (type == NRF_WINDOW_FLAT_TOP) {
+        return 0.21557895 - 0.41663158 * cos(x) + 0.277263158 * cos(2 * x) - 0.083578947 * cos(3 * x) + 0.006947368 * cos(4 * x);
+    } else {
+        return 1.0;
+    }
+}
+
+// The number of segments that fit in the given number of samples.
+static int _nrf_spectrum_segment_count(nrf_spectrum *spectrum, int length) {
+    if (!spectrum->averaging || length <= spectrum->fft_size) return 1;
+    int hop = spectrum->fft_size - (int) (spectrum->fft_size * spectrum->overlap);
+    hop = hop < 1 ? 1 : hop;
+    return (length - spectrum->fft_size) / hop + 1;
+}
+
+nrf_spectrum *nrf_spectrum_new(nrf_fft_config config) {
+    int fft_size = config.fft_size > 0 ? config.fft_size : DEFAULT_FFT_SIZE;
+    nrf_spectrum *spectrum = calloc(1, sizeof(nrf_spectrum));
+    spectrum->fft_size = fft_size;
+    spectrum->averaging = config.averaging;
+    spectrum->overlap = config.overlap > 0 && config.overlap < 1 ? config.overlap : NRF_FFT_DEFAULT_OVERLAP;
+
+    // Plan all segments of a block as one batch.
+    spectrum->n_segments = _nrf_spectrum_segment_count(spectrum, NRF_SAMPLES_LENGTH);
+    if (config.max_segments > 0 && spectrum->n_segments > config.max_segments) {
+        spectrum->n_segments = config.max_segments;
+    }
+
+    // Flipping the sign of every odd sample moves DC to the middle bin, so
+    // the output needs no shift. It is folded into the window for free.
+    spectrum->window = calloc(fft_size, sizeof(float));
+    double window_sum = 0;
+    for (int i = 0; i < fft_size; i++) {
+        double w = _nrf_window_value(config.window, i, fft_size);
+        window_sum += w;
+        spectrum->window[i] = i % 2 == 0 ? w : -w;
+    }
+    spectrum->window_gain = window_sum;
+    spectrum->patch_dc = config.window == NRF_WINDOW_NONE && fft_size > 2;
+
+    int total_size = fft_size * spectrum->n_segments;
+    spectrum->fft_in = (fftwf_complex*) fftwf_malloc(sizeof(fftwf_complex) * total_size);
+    spectrum->fft_out = (fftwf_complex*) fftwf_malloc(sizeof(fftwf_complex) * total_size);
+    spectrum->fft_plan = _nrf_fftw_plan(fft_size, spectrum->n_segments, spectrum->fft_in, spectrum->fft_out, FFTW_FORWARD, config.threads, config.wisdom_file);
+    memset(spectrum->fft_in, 0, sizeof(fftwf_complex) * total_size);
+    return spectrum;
+}
+
+// Writes fft_size values to out. With averaging, these are in dBFS,
+// otherwise they are the magnitude of each bin.
+void nrf_spectrum_process(nrf_spectrum *spectrum, nut_buffer *buffer, float *out) {
+    assert(buffer->channels == 2);
+    int size = spectrum->fft_size;
+
+    // Spread the segments evenly over the block. Without averaging, only the
+    // first fft_size samples are used.
+    int segments = _nrf_spectrum_segment_count(spectrum, buffer->length);
+    segments = segments < spectrum->n_segments ? segments : spectrum->n_segments;
+    int step = segments > 1 ? (buffer->length - size) / (segments - 1) : 0;
+    for (int s = 0; s < segments; s++) {
+        float *in = (float *) (spectrum->fft_in + s * size);
+        int offset = s * step;
+        int length = buffer->length - offset < size ? buffer->length - offset : size;
+        if (buffer->type == NUT_BUFFER_U8) {
+            // Raw samples are offset binary. Center them like the IQ
+            // converter does, so full scale is 1 and there is no DC offset.
+            const uint8_t *u8 = buffer->data.u8 + offset * 2;
+            for (int i = 0; i < length * 2; i++) {
+                in[i] = (u8[i] - 127.5f) * (1.0f / 128);
+            }
+        } else {
+            nut_buffer_read_f32(buffer, offset * 2, length * 2, in);
+        }
+        memset(in + length * 2, 0, (size - length) * sizeof(fftwf_complex));
+        for (int i = 0; i < size; i++) {
+            in[i * 2] *= spectrum->window[i];
+            in[i * 2 + 1] *= spectrum->window[i];
+        }
+    }
+    fftwf_execute(spectrum->fft_plan);
+
+    float scale = 1.0f / (segments * spectrum->window_gain * spectrum->window_gain);
+    for (int i = 0; i < size; i++) {
+        float pwr = 0;
+        for (int s = 0; s < segments; s++) {
+            float fi = spectrum->fft_out[s * size + i][0];
+            float fq = spectrum->fft_out[s * size + i][1];
+            pwr += fi * fi + fq * fq;
+        }
+        if (spectrum->averaging) {
+            out[i] = 10 * log10f(pwr * scale + 1e-20f);
+        } else {
+            out[i] = sqrtf(pwr);
+        }
+    }
+    // Hide the receiver's DC spike. Without a window it only shows in the
+    // middle bin. A window spreads it over the bins next to it, so patching
+    // one bin would only copy the spike; then it is left alone.
+    if (spectrum->patch_dc) {
+        out[size / 2] = (out[size / 2 - 1] + out[size / 2 + 1]) / 2;
+    }
+}
+
+void nrf_spectrum_free(nrf_spectrum *spectrum) {
+    _nrf_fftw_destroy_plan(spectrum->fft_plan);
+    fftwf_free(spectrum->fft_in);
+    fftwf_free(spectrum->fft_out);
+    free(spectrum->window);
+    free(spectrum);
+}
+
+nrf_fft *nrf_fft_new(int fft_size, int fft_history_size) {
+    nrf_fft_config config;
+    memset(&config, 0, sizeof(nrf_fft_config));
+    config.fft_size = fft_size;
+    config.fft_history_size = fft_history_size;
+    return nrf_fft_new_with_config(config);
+}
+
+nrf_fft *nrf_fft_new_with_config(nrf_fft_config config) {
+    int fft_size = config.fft_size > 0 ? config.fft_size : DEFAULT_FFT_SIZE;
+    int fft_history_size = config.fft_history_size > 0 ? config.fft_history_size : DEFAULT_FFT_HISTORY_SIZE;
+    nrf_fft *fft = calloc(1, sizeof(nrf_fft));
+    nrf_block_init(&fft->block, NRF_BLOCK_GENERIC, (nrf_block_process_fn) nrf_fft_process, (nrf_block_result_fn) nrf_fft_get_line);
+    fft->fft_size = fft_size;
+    fft->fft_history_size = fft_history_size;
+    fft->spectrum = nrf_spectrum_new(config);
+    fft->line = calloc(fft_size, sizeof(float));
+    fft->line_buffer = nut_buffer_new_f32(fft_size, 1, NULL);
+    fft->history = calloc(fft_size * fft_history_size, sizeof(float));
+    fft->history_shift = calloc(fft_history_size, sizeof(int));
+    pthread_mutex_init(&fft->history_mutex, NULL);
+    return fft;
+}
+
+void nrf_fft_shift(nrf_fft *fft, double d) {
+    int shift_pixels = round(fft->fft_size / d);
+    if (shift_pixels == 0) return;
+    pthread_mutex_lock(&fft->history_mutex);
+    fft->shift += shift_pixels;
+    pthread_mutex_unlock(&fft->history_mutex);
+}
+
+void nrf_fft_process(nrf_fft *fft, nut_buffer *buffer) {
+    nrf_spectrum_process(fft->spectrum, buffer, fft->line);
+
+    // Overwrite the oldest line
+    pthread_mutex_lock(&fft->history_mutex);
+    fft->history_head = (fft->history_head + fft->fft_history_size - 1) % fft->fft_history_size;
+    fft->history_shift[fft->history_head] = fft->shift;
+    memcpy(fft->history + fft->history_head * fft->fft_size, fft->line, fft->fft_size * sizeof(float));
+    // Someone still holds the last line, so start a new one.
+    if (!nut_buffer_is_writable(fft->line_buffer)) {
+        nut_buffer_release(fft->line_buffer);
+        fft->line_buffer = nut_buffer_new_f32(fft->fft_size, 1, NULL);
+    }
+    memcpy(fft->line_buffer->data.f32, fft->line, fft->fft_size * sizeof(float));
+    pthread_mutex_unlock(&fft->history_mutex);
+}
+
+// Returns a view of the newest line. This is the block result.
+nut_buffer *nrf_fft_get_line(nrf_fft *fft) {
+    pthread_mutex_lock(&fft->history_mutex);
+    nut_buffer *line = nut_buffer_copy(fft->line_buffer);
+    pthread_mutex_unlock(&fft->history_mutex);
+    return line;
+}
+
+// Copies the history starting at the given row. Lines that were not shifted
+// since they were written are copied as contiguous spans.
+static nut_buffer *_nrf_fft_copy_history(nrf_fft *fft, int first_row, int *head) {
+    int size = fft->fft_size;
+    nut_buffer *buffer = nut_buffer_new_f32(size * fft->fft_history_size, 1, NULL);
+    float *dst = buffer->data.f32;
+    pthread_mutex_lock(&fft->history_mutex);
+    if (first_row < 0) {
+        first_row = fft->history_head;
+    }
+    if (head != NULL) {
+        *head = fft->history_head;
+    }
+    int y = 0;
+    while (y < fft->fft_history_size) {
+        int row = (first_row + y) % fft->fft_history_size;
+        int d = fft->shift - fft->history_shift[row];
+        if (d == 0) {
+            int rows = 1;
+            while (y + rows < fft->fft_history_size && row + rows < fft->fft_history_size && fft->history_shift[row + rows] == fft->shift) {
+                rows++;
+            }
+            memcpy(dst + y * size, fft->history + row * size, rows * size * sizeof(float));
+            y += rows;
+            continue;
+        }
+        float *line = dst + y * size;
+        memset(line, 0, size * sizeof(float));
+        if (abs(d) < size) {
+            float *src = fft->history + row * size;
+            if (d > 0) {
+                memcpy(line, src + d, (size - d) * sizeof(float));
+            } else {
+                memcpy(line - d, src, (size + d) * sizeof(float));
+            }
+        }
+        y++;
+    }
+    pthread_mutex_unlock(&fft->history_mutex);
+    return buffer;
+}
+
+// Copies the history, newest line first.
+nut_buffer *nrf_fft_get_buffer(nrf_fft *fft) {
+    return _nrf_fft_copy_history(fft, -1, NULL);
+}
+
+// Copies the history as it is stored, which is one span if nothing was
+// shifted. The newest line is at row head, older lines follow it and wrap
+// around, so a texture can be drawn with its y coordinate offset by head.
+nut_buffer *nrf_fft_get_ring_buffer(nrf_fft *fft, int *head) {
+    return _nrf_fft_copy_history(fft, 0, head);
+}
+
+void nrf_fft_free(nrf_fft *fft) {
+    nrf_block_deinit(&fft->block);
+    nrf_spectrum_free(fft->spectrum);
+    free(fft->line);
+    nut_buffer_release(fft->line_buffer);
+    free(fft->history);
+    free(fft->history_shift);
+    pthread_mutex_destroy(&fft->history_mutex);
+    free(fft);
+}
+
+// Finite Impulse Response (FIR) Filter
+
+// Fills coefs with a Blackman-windowed sinc low-pass filter. The frequency
+// is relative to the sample rate.
+static void _nrf_fir_low_pass(double freq, int length, double *coefs) {
+    int center = floor(length / 2);
+    double sum = 0;
+    for (int i = 0; i < length; i++) {
+        double val;
+        if (i == center) {
+            val = TAU * freq;
+        } else {
+            double angle = TAU * (i + 1) / (double) (length + 1);
+            val = sin(TAU * freq * (i - center)) / (double) (i - center);
+            val *= 0.42 - 0.5 * cos(angle) + 0.08 * cos(2 * angle);
+        }
+        sum += val;
+        coefs[i] = val;
+    }
+    for (int i = 0; i < length; i++) {
+        coefs[i] /= sum;
+    }
+}
+
+// Generates coefficients for a FIR low-pass filter with the given
+// half-amplitude frequency and kernel length at the given sample rate.
+//
+// sample_rate    - The signal's sample rate.
+// half_ampl_freq - The half-amplitude frequency in Hz.
+// length         - The filter kernel's length. Should be an odd number.
+//
+// Returns the FIR coefficients for the filter.
+double *nrf_fir_get_low_pass_coefficients(int sample_rate, int half_ampl_freq, int length) {
+    length += (length + 1) % 2;
+    double *coefs = calloc(length, sizeof(double));
+    _nrf_fir_low_pass(half_ampl_freq / (double) sample_rate, length, coefs);
+    return coefs;
+}
+
+// FIR kernels
+
+// Each kernel computes the dot product of a and b in four lanes, where lane
+// j sums the products at indices i with i % 4 == j. With interleaved I/Q
+// data, lanes 0 and 2 hold I and lanes 1 and 3 hold Q.
+typedef void (*_nrf_dot_lanes_fn)(const float *a, const float *b, int n, float *lanes);
+
+// Written with separate partial sums so the compiler can vectorize it.
+static void _nrf_dot_lanes_scalar(const float *restrict a, const float *restrict b, int n, float *lanes) {
+    float acc[8] = { 0 };
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        for (int j = 0; j < 8; j++) {
+            acc[j] += a[i + j] * b[i + j];
+        }
+    }
+    for (int j = 0; j < 4; j++) {
+        lanes[j] = acc[j] + acc[j + 4];
+    }
+    for (; i < n; i++) {
+        lanes[i % 4] += a[i] * b[i];
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+static void _nrf_dot_lanes_sse(const float *a, const float *b, int n, float *lanes) {
+    __m128 acc0 = _mm_setzero_ps();
+    __m128 acc1 = _mm_setzero_ps();
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        acc0 = _mm_add_ps(acc0, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+        acc1 = _mm_add_ps(acc1, _mm_mul_ps(_mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4)));
+    }
+    for (; i + 4 <= n; i += 4) {
+        acc0 = _mm_add_ps(acc0, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+    }
+    _mm_storeu_ps(lanes, _mm_add_ps(acc0, acc1));
+    for (; i < n; i++) {
+        lanes[i % 4] += a[i] * b[i];
+    }
+}
+
+__attribute__((target("avx2,fma")))
+static void _nrf_dot_lanes_avx2(const float *a, const float *b, int n, float *lanes) {
+    __m256 acc0 = _mm256_setzero_ps();
+    __m256 acc1 = _mm256_setzero_ps();
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), acc0);
+        acc1 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8), acc1);
+    }
+    for (; i + 8 <= n; i += 8) {
+        acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), acc0);
+    }
+    acc0 = _mm256_add_ps(acc0, acc1);
+    _mm_storeu_ps(lanes, _mm_add_ps(_mm256_castps256_ps128(acc0), _mm256_extractf128_ps(acc0, 1)));
+    for (; i < n; i++) {
+        lanes[i % 4] += a[i] * b[i];
+    }
+}
+
+#endif
+
+static _nrf_dot_lanes_fn _nrf_dot_lanes = _nrf_dot_lanes_scalar;
+static const char *_nrf_fir_kernel_name = "scalar";
+static pthread_once_t _nrf_fir_kernel_once = PTHREAD_ONCE_INIT;
+
+static void _nrf_fir_select_kernel() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        _nrf_dot_lanes = _nrf_dot_lanes_avx2;
+        _nrf_fir_kernel_name = "avx2";
+    } else if (__builtin_cpu_supports("sse2")) {
+        _nrf_dot_lanes = _nrf_dot_lanes_sse;
+        _nrf_fir_kernel_name = "sse";
+    }
+#endif
+}
+
+// Returns the name of the FIR kernel for this CPU: "avx2", "sse" or "scalar".
+const char *nrf_fir_kernel() {
+    pthread_once(&_nrf_fir_kernel_once, _nrf_fir_select_kernel);
+    return _nrf_fir_kernel_name;
+}
+
+float nrf_fir_dot_f32(const float *coefficients, const float *samples, int length) {
+    float lanes[4];
+    pthread_once(&_nrf_fir_kernel_once, _nrf_fir_select_kernel);
+    _nrf_dot_lanes(coefficients, samples, length, lanes);
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3];
+}
+
+void nrf_fir_dot_cf32(const float *coefficients, const float *samples, int length, float *out) {
+    float lanes[4];
+    pthread_once(&_nrf_fir_kernel_once, _nrf_fir_select_kernel);
+    _nrf_dot_lanes(coefficients, samples, length * 2, lanes);
+    out[0] = lanes[0] + lanes[2];
+    out[1] = lanes[1] + lanes[3];
+}
+
+nrf_fir_filter *nrf_fir_filter_new(int sample_rate, int half_ampl_freq, int length) {
+    nrf_fir_filter *filter = calloc(1, sizeof(nrf_fir_filter));
+    filter->length = length;
     filter->coefficients = nrf_fir_get_low_pass_coefficients(sample_rate, half_ampl_freq, length);
     filter->offset = length - 1;
     filter->center = floor(length / 2);
@@ -725,151 +1913,758 @@ void nrf_fir_filter_free(nrf_fir_filter *filter) {
     free(filter);
 }
 
+// FFT Filter
+
+nrf_fft_filter *nrf_fft_filter_new_with_config(nrf_fft_filter_config config) {
+    nrf_fft_filter *f = calloc(1, sizeof(nrf_fft_filter));
+    nrf_block_init(&f->block, NRF_BLOCK_GENERIC, (nrf_block_process_fn) nrf_fft_filter_process, (nrf_block_result_fn) nrf_fft_filter_get_buffer);
+    int decimation = config.decimation > 0 ? config.decimation : 1;
+    double *taps = nrf_fir_get_low_pass_coefficients(config.sample_rate, config.half_ampl_freq, config.kernel_length);
+    int length = config.kernel_length + (config.kernel_length + 1) % 2;
+
+    // The samples kept from the previous frame, rounded up so output
+    // samples stay on multiples of the decimation.
+    int overlap = (length - 1 + decimation - 1) / decimation * decimation;
+    int fft_size = config.fft_size;
+    if (fft_size <= 0) {
+        int bins = 1;
+        while (bins * decimation < overlap * 4 || bins < 64) {
+            bins *= 2;
+        }
+        fft_size = bins * decimation;
+    }
+    fft_size = (fft_size + decimation - 1) / decimation * decimation;
+    if (fft_size <= overlap) {
+        fprintf(stderr, "ERROR nrf_fft_filter: FFT size %d is too small for %d taps.\n", fft_size, length);
+        exit(1);
+    }
+    f->fft_size = fft_size;
+    f->decimation = decimation;
+    f->overlap = overlap;
+    // The frame starts with overlap samples of silence before the input.
+    f->fill = overlap;
+    f->time = fft_size - overlap;
+    f->shift_bins = (int) round(config.freq_offset * (double) fft_size / config.sample_rate) % fft_size;
+    f->shift_bins = f->shift_bins < 0 ? f->shift_bins + fft_size : f->shift_bins;
+
+    int bins = fft_size / decimation;
+    f->fft_in = (fftwf_complex*) fftwf_malloc(sizeof(fftwf_complex) * fft_size);
+    f->fft_out = (fftwf_complex*) fftwf_malloc(sizeof(fftwf_complex) * fft_size);
+    f->ifft_in = (fftwf_complex*) fftwf_malloc(sizeof(fftwf_complex) * bins);
+    f->ifft_out = (fftwf_complex*) fftwf_malloc(sizeof(fftwf_complex) * bins);
+    f->forward_plan = _nrf_fftw_plan(fft_size, 1, f->fft_in, f->fft_out, FFTW_FORWARD, 1, NULL);
+    f->inverse_plan = _nrf_fftw_plan(bins, 1, f->ifft_in, f->ifft_out, FFTW_BACKWARD, 1, NULL);
+
+    // The frequency response, scaled so the inverse FFT needs no scaling.
+    memset(f->fft_in, 0, sizeof(fftwf_complex) * fft_size);
+    for (int i = 0; i < length; i++) {
+        f->fft_in[i][0] = taps[i];
+    }
+    free(taps);
+    fftwf_execute(f->forward_plan);
+    f->response = (fftwf_complex*) fftwf_malloc(sizeof(fftwf_complex) * fft_size);
+    for (int i = 0; i < fft_size; i++) {
+        f->response[i][0] = f->fft_out[i][0] / fft_size;
+        f->response[i][1] = f->fft_out[i][1] / fft_size;
+    }
+    memset(f->fft_in, 0, sizeof(fftwf_complex) * fft_size);
+    return f;
+}
+
+// Filters the frame in fft_in, and writes the output for the advance
+// samples after the overlap. Returns the number of output samples.
+static int _nrf_fft_filter_frame(nrf_fft_filter *f, int advance, float *out) {
+    const int fft_size = f->fft_size;
+    const int bins = fft_size / f->decimation;
+    fftwf_execute(f->forward_plan);
+
+    // Shift the spectrum down, filter it and fold it into fft_size /
+    // decimation bins, which decimates the output.
+    memset(f->ifft_in, 0, sizeof(fftwf_complex) * bins);
+    int src = f->shift_bins;
+    for (int k = 0; k < fft_size; k += bins) {
+        for (int j = 0; j < bins; j++) {
+            float xr = f->fft_out[src][0];
+            float xi = f->fft_out[src][1];
+            float hr = f->response[k + j][0];
+            float hi = f->response[k + j][1];
+            f->ifft_in[j][0] += xr * hr - xi * hi;
+            f->ifft_in[j][1] += xr * hi + xi * hr;
+            src = src + 1 == fft_size ? 0 : src + 1;
+        }
+    }
+    fftwf_execute(f->inverse_plan);
+
+    // The shift above restarts at every frame. Rotate the output by the
+    // phase of the shift at the frame's first sample to keep it continuous.
+    double phase = -TAU * f->shift_bins * (double) f->time / fft_size;
+    float rc = cos(phase);
+    float rs = sin(phase);
+    int first = f->overlap / f->decimation;
+    int count = advance / f->decimation;
+    for (int i = 0; i < count; i++) {
+        float yr = f->ifft_out[first + i][0];
+        float yi = f->ifft_out[first + i][1];
+        out[i * 2] = yr * rc - yi * rs;
+        out[i * 2 + 1] = yr * rs + yi * rc;
+    }
+    f->time = (int) (((int64_t) f->time + advance) % fft_size);
+    return count;
+}
+
+void nrf_fft_filter_process(nrf_fft_filter *f, nut_buffer *buffer) {
+    assert(buffer->channels == 2);
+    int capacity = (f->fill - f->overlap + buffer->length) / f->decimation + 1;
+    // A held output would be copied only to be overwritten; start a new one.
+    if (f->buffer != NULL && (f->buffer->length < capacity || !nut_buffer_is_writable(f->buffer))) {
+        nut_buffer_release(f->buffer);
+        f->buffer = NULL;
+    }
+    if (f->buffer == NULL) {
+        f->buffer = nut_buffer_new_cf32(capacity, 2, NULL);
+    }
+    float *out = f->buffer->data.f32;
+
+    // Filter every full frame. The last frame is filtered even if it is not
+    // full, since a causal filter has all the samples it needs. This way
+    // each block produces all of its output right away.
+    int n = 0;
+    int offset = 0;
+    while (offset < buffer->length) {
+        int count = f->fft_size - f->fill;
+        count = count < buffer->length - offset ? count : buffer->length - offset;
+        nut_buffer_read_f32(buffer, offset * 2, count * 2, (float *) (f->fft_in + f->fill));
+        f->fill += count;
+        offset += count;
+        int advance = (f->fill - f->overlap) / f->decimation * f->decimation;
+        if (advance > 0) {
+            n += _nrf_fft_filter_frame(f, advance, out + n * 2);
+            memmove(f->fft_in, f->fft_in + advance, sizeof(fftwf_complex) * (f->fill - advance));
+            f->fill -= advance;
+        }
+    }
+    f->out_length = n;
+}
+
+nut_buffer *nrf_fft_filter_get_buffer(nrf_fft_filter *f) {
+    if (f->buffer == NULL) {
+        return nut_buffer_new_cf32(0, 2, NULL);
+    }
+    return nut_buffer_new_view(f->buffer, 0, f->out_length);
+}
+
+void nrf_fft_filter_free(nrf_fft_filter *f) {
+    nrf_block_deinit(&f->block);
+    _nrf_fftw_destroy_plan(f->forward_plan);
+    _nrf_fftw_destroy_plan(f->inverse_plan);
+    fftwf_free(f->fft_in);
+    fftwf_free(f->fft_out);
+    fftwf_free(f->ifft_in);
+    fftwf_free(f->ifft_out);
+    fftwf_free(f->response);
+    if (f->buffer != NULL) {
+        nut_buffer_release(f->buffer);
+    }
+    free(f);
+}
+
+// Channelizer
+
+static nut_buffer *_nrf_channelizer_output_get_buffer(nrf_channelizer_output *output) {
+    if (output->buffer == NULL) {
+        return nut_buffer_new_cf32(0, 2, NULL);
+    }
+    return nut_buffer_copy(output->buffer);
+}
+
+nrf_channelizer *nrf_channelizer_new(int n_channels, int taps_per_channel) {
+    nrf_channelizer *c = calloc(1, sizeof(nrf_channelizer));
+    nrf_block_init(&c->block, NRF_BLOCK_GENERIC, (nrf_block_process_fn) nrf_channelizer_process, (nrf_block_result_fn) nrf_channelizer_get_buffer);
+    c->n_channels = n_channels;
+    c->taps = taps_per_channel > 0 ? taps_per_channel : NRF_CHANNELIZER_DEFAULT_TAPS;
+
+    // The prototype low-pass passes half a channel on each side of 0 Hz.
+    int length = n_channels * c->taps;
+    double *prototype = calloc(length, sizeof(double));
+    _nrf_fir_low_pass(0.5 / n_channels, length, prototype);
+    c->coefficients = calloc(length, sizeof(float));
+    for (int i = 0; i < length; i++) {
+        c->coefficients[i] = prototype[i];
+    }
+    free(prototype);
+
+    // The history holds the samples before the first new one, and the time
+    // of the next output sample.
+    c->samples_length = length - 1;
+    c->samples = calloc(c->samples_length * 2, sizeof(float));
+    c->next_output = length - 1;
+
+    c->fft_in = (fftwf_complex*) fftwf_malloc(sizeof(fftwf_complex) * n_channels * NRF_CHANNELIZER_BATCH);
+    c->fft_out = (fftwf_complex*) fftwf_malloc(sizeof(fftwf_complex) * n_channels * NRF_CHANNELIZER_BATCH);
+    c->fft_plan = _nrf_fftw_plan(n_channels, NRF_CHANNELIZER_BATCH, c->fft_in, c->fft_out, FFTW_BACKWARD, 0, NULL);
+
+    c->outputs = calloc(n_channels, sizeof(nrf_channelizer_output));
+    for (int i = 0; i < n_channels; i++) {
+        nrf_block_init(&c->outputs[i].block, NRF_BLOCK_GENERIC, NULL, (nrf_block_result_fn) _nrf_channelizer_output_get_buffer);
+        c->outputs[i].channel = i;
+    }
+    return c;
+}
+
+// Transforms the first count rows of fft_in and writes them to the output,
+// starting at the given output sample.
+static void _nrf_channelizer_flush(nrf_channelizer *c, int count, int first, int out_length, float *out) {
+    fftwf_execute(c->fft_plan);
+    for (int k = 0; k < c->n_channels; k++) {
+        float *dst = out + (k * out_length + first) * 2;
+        for (int m = 0; m < count; m++) {
+            dst[m * 2] = c->fft_out[m * c->n_channels + k][0];
+            dst[m * 2 + 1] = c->fft_out[m * c->n_channels + k][1];
+        }
+    }
+}
+
+// Every n_channels input samples, each branch p of the filter bank filters
+// the samples at p, p + n_channels, ..., and an inverse FFT over the
+// branches gives one output sample per channel. Channel k is centered on
+// k / n_channels times the sample rate.
+void nrf_channelizer_process(nrf_channelizer *c, nut_buffer *buffer) {
+    assert(buffer->channels == 2);
+    const int n = c->n_channels;
+    const int taps = c->taps;
+    int history = n * taps - 1;
+    if (history + buffer->length != c->samples_length) {
+        float *samples = calloc((history + buffer->length) * 2, sizeof(float));
+        memcpy(samples, c->samples + (c->samples_length - history) * 2, history * 2 * sizeof(float));
+        free(c->samples);
+        c->samples = samples;
+        c->samples_length = history + buffer->length;
+    }
+    nut_buffer_read_f32(buffer, 0, buffer->length * 2, c->samples + history * 2);
+
+    int out_length = c->next_output < c->samples_length ? (c->samples_length - 1 - c->next_output) / n + 1 : 0;
+    // Drop the channel views of the last block first, so the buffer can be
+    // reused. If a consumer still holds it, start a new one: all of it is
+    // overwritten, so there is nothing to copy.
+    for (int k = 0; k < n; k++) {
+        if (c->outputs[k].buffer != NULL) {
+            nut_buffer_release(c->outputs[k].buffer);
+            c->outputs[k].buffer = NULL;
+        }
+    }
+    if (c->buffer != NULL && (c->buffer->length != out_length * n || !nut_buffer_is_writable(c->buffer))) {
+        nut_buffer_release(c->buffer);
+        c->buffer = NULL;
+    }
+    if (c->buffer == NULL) {
+        c->buffer = nut_buffer_new_cf32(out_length * n, 2, NULL);
+    }
+    float *out = c->buffer->data.f32;
+
+    int row = 0;
+    int first = 0;
+    for (int m = 0; m < out_length; m++) {
+        const float *x = c->samples + (c->next_output + m * n) * 2;
+        fftwf_complex *v = c->fft_in + row * n;
+        for (int p = 0; p < n; p++) {
+            float vi = 0;
+            float vq = 0;
+            for (int t = 0; t < taps; t++) {
+                float h = c->coefficients[p + t * n];
+                vi += h * x[-(p + t * n) * 2];
+                vq += h * x[-(p + t * n) * 2 + 1];
+            }
+            v[p][0] = vi;
+            v[p][1] = vq;
+        }
+        if (++row == NRF_CHANNELIZER_BATCH) {
+            _nrf_channelizer_flush(c, row, first, out_length, out);
+            first += row;
+            row = 0;
+        }
+    }
+    if (row > 0) {
+        _nrf_channelizer_flush(c, row, first, out_length, out);
+    }
+    c->next_output += out_length * n - buffer->length;
+    memmove(c->samples, c->samples + buffer->length * 2, history * 2 * sizeof(float));
+    c->out_length = out_length;
+
+    // Each channel's output is a view of its part of the buffer.
+    for (int k = 0; k < n; k++) {
+        nrf_channelizer_output *output = &c->outputs[k];
+        output->buffer = nut_buffer_new_view(c->buffer, k * out_length, out_length);
+        nrf_block_process(&output->block, NULL);
+    }
+}
+
+// All channels, one after the other: the output samples of channel 0, then
+// channel 1, and so on.
+nut_buffer *nrf_channelizer_get_buffer(nrf_channelizer *c) {
+    if (c->buffer == NULL) {
+        return nut_buffer_new_cf32(0, 2, NULL);
+    }
+    return nut_buffer_new_view(c->buffer, 0, c->buffer->length);
+}
+
+nut_buffer *nrf_channelizer_get_channel_buffer(nrf_channelizer *c, int channel) {
+    assert(channel >= 0 && channel < c->n_channels);
+    return _nrf_channelizer_output_get_buffer(&c->outputs[channel]);
+}
+
+nrf_block *nrf_channelizer_get_output(nrf_channelizer *c, int channel) {
+    assert(channel >= 0 && channel < c->n_channels);
+    return &c->outputs[channel].block;
+}
+
+void nrf_channelizer_free(nrf_channelizer *c) {
+    nrf_block_deinit(&c->block);
+    for (int i = 0; i < c->n_channels; i++) {
+        nrf_block_deinit(&c->outputs[i].block);
+        if (c->outputs[i].buffer != NULL) {
+            nut_buffer_release(c->outputs[i].buffer);
+        }
+    }
+    free(c->outputs);
+    _nrf_fftw_destroy_plan(c->fft_plan);
+    fftwf_free(c->fft_in);
+    fftwf_free(c->fft_out);
+    free(c->coefficients);
+    free(c->samples);
+    if (c->buffer != NULL) {
+        nut_buffer_release(c->buffer);
+    }
+    free(c);
+}
+
 // IQ Filter
 
 nrf_iq_filter *nrf_iq_filter_new(int sample_rate, int half_ampl_freq, int kernel_length) {
     nrf_iq_filter *f = calloc(1, sizeof(nrf_iq_filter));
     nrf_block_init(&f->block, NRF_BLOCK_GENERIC, (nrf_block_process_fn) nrf_iq_filter_process, (nrf_block_result_fn) nrf_iq_filter_get_buffer);
-    f->filter_i = nrf_fir_filter_new(sample_rate, half_ampl_freq, kernel_length);
-    f->filter_q = nrf_fir_filter_new(sample_rate, half_ampl_freq, kernel_length);
+    // Long kernels are cheaper to apply with FFT convolution.
+    if (kernel_length >= NRF_FFT_FILTER_MIN_TAPS) {
+        nrf_fft_filter_config config;
+        memset(&config, 0, sizeof(nrf_fft_filter_config));
+        config.sample_rate = sample_rate;
+        config.half_ampl_freq = half_ampl_freq;
+        config.kernel_length = kernel_length;
+        f->fft_filter = nrf_fft_filter_new_with_config(config);
+        return f;
+    }
+    double *coefficients = nrf_fir_get_low_pass_coefficients(sample_rate, half_ampl_freq, kernel_length);
+    f->taps = kernel_length + (kernel_length + 1) % 2;
+    // Reversed and doubled, to line up with the interleaved history.
+    f->coefficients = calloc(f->taps * 2, sizeof(float));
+    for (int i = 0; i < f->taps; i++) {
+        f->coefficients[i * 2] = f->coefficients[i * 2 + 1] = coefficients[f->taps - 1 - i];
+    }
+    free(coefficients);
+    f->samples_length = f->taps - 1;
+    f->samples = calloc(f->samples_length * 2, sizeof(float));
     return f;
 }
 
 void nrf_iq_filter_process(nrf_iq_filter *filter, nut_buffer *buffer) {
-    int old_length = filter->samples_length;
+    assert(buffer->channels == 2);
+    if (filter->fft_filter != NULL) {
+        nrf_fft_filter_process(filter->fft_filter, buffer);
+        return;
+    }
     int length = buffer->length;
-    if (length != old_length) {
-        free(filter->samples_i);
-        free(filter->samples_q);
-        filter->samples_i = calloc(length, sizeof(double));
-        filter->samples_q = calloc(length, sizeof(double));
+    int history = filter->taps - 1;
+
+    // The samples are the last taps - 1 input samples, followed by the new ones.
+    if (history + length != filter->samples_length) {
+        float *samples = calloc((history + length) * 2, sizeof(float));
+        memcpy(samples, filter->samples + (filter->samples_length - history) * 2, history * 2 * sizeof(float));
+        free(filter->samples);
+        filter->samples = samples;
+        filter->samples_length = history + length;
     }
-    filter->samples_length = length;
+    nut_buffer_read_f32(buffer, 0, length * 2, filter->samples + history * 2);
 
-    int j = 0;
-    for (int i = 0; i < length * 2; i += 2) {
-        filter->samples_i[j] = nut_buffer_get_f64(buffer, i);
-        filter->samples_q[j] = nut_buffer_get_f64(buffer, i + 1);
-        j++;
+    // The output is overwritten completely, so if a consumer still holds
+    // the last one, start a new buffer instead of copying it.
+    if (filter->buffer != NULL && (filter->buffer->length != length || !nut_buffer_is_writable(filter->buffer))) {
+        nut_buffer_release(filter->buffer);
+        filter->buffer = NULL;
+    }
+    if (filter->buffer == NULL) {
+        filter->buffer = nut_buffer_new_cf32(length, 2, NULL);
     }
-    nrf_fir_filter_load(filter->filter_i, filter->samples_i, length);
-    nrf_fir_filter_load(filter->filter_q, filter->samples_q, length);
+    float *out = filter->buffer->data.f32;
+    for (int i = 0; i < length; i++) {
+        nrf_fir_dot_cf32(filter->coefficients, filter->samples + i * 2, filter->taps, out + i * 2);
+    }
+    memmove(filter->samples, filter->samples + length * 2, history * 2 * sizeof(float));
 }
 
 nut_buffer *nrf_iq_filter_get_buffer(nrf_iq_filter *f) {
-    int length = f->samples_length;
-    nut_buffer *result = nut_buffer_new_f64(length, 2, NULL);
-    int k = 0;
-    for (int i = 0; i < length; i++) {
-        result->data.f64[k++] = nrf_fir_filter_get(f->filter_i, i);
-        result->data.f64[k++] = nrf_fir_filter_get(f->filter_q, i);
+    if (f->fft_filter != NULL) {
+        return nrf_fft_filter_get_buffer(f->fft_filter);
     }
-    return result;
+    if (f->buffer == NULL) {
+        return nut_buffer_new_cf32(0, 2, NULL);
+    }
+    return nut_buffer_copy(f->buffer);
 }
 
 void nrf_iq_filter_free(nrf_iq_filter *f) {
-    nrf_fir_filter_free(f->filter_i);
-    nrf_fir_filter_free(f->filter_q);
-    free(f->samples_i);
-    free(f->samples_q);
+    nrf_block_deinit(&f->block);
+    if (f->fft_filter != NULL) {
+        nrf_fft_filter_free(f->fft_filter);
+    }
+    free(f->coefficients);
+    free(f->samples);
+    if (f->buffer != NULL) {
+        nut_buffer_release(f->buffer);
+    }
     free(f);
 }
 
 // Downsampler
 
+static int _nrf_gcd(int a, int b) {
+    while (b != 0) {
+        int t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+// A polyphase resampler. The output rate is in_rate * L / M, where L / M
+// is the reduced ratio of the rates. The low-pass prototype is designed at
+// L times the input rate and split into L phases of kernel_length taps, so
+// each output sample is a single kernel_length dot product. If L is larger
+// than NRF_DOWNSAMPLER_MAX_PHASES, the nearest of that many phases is used.
+// The output timing stays exact.
 nrf_downsampler *nrf_downsampler_new(int in_rate, int out_rate, int filter_freq, int kernel_length) {
     nrf_downsampler *d = calloc(1, sizeof(nrf_downsampler));
     d->in_rate = in_rate;
     d->out_rate = out_rate;
-    d->filter = nrf_fir_filter_new(in_rate, filter_freq, kernel_length);
-    d->rate_mul = in_rate / (double) out_rate;
-    d->out_length = 0;
-    d->out_samples = NULL;
+    int gcd = _nrf_gcd(in_rate, out_rate);
+    d->interpolation = out_rate / gcd;
+    d->decimation = in_rate / gcd;
+    d->phases = d->interpolation < NRF_DOWNSAMPLER_MAX_PHASES ? d->interpolation : NRF_DOWNSAMPLER_MAX_PHASES;
+    // Pad each phase with zeros to a multiple of NRF_DOWNSAMPLER_TAP_ALIGN
+    // taps, so the FIR kernels never run their scalar tail.
+    d->taps = (kernel_length + NRF_DOWNSAMPLER_TAP_ALIGN - 1) / NRF_DOWNSAMPLER_TAP_ALIGN * NRF_DOWNSAMPLER_TAP_ALIGN;
+
+    // Split the prototype into phases, with the taps of each phase reversed
+    // so they line up with the history.
+    int prototype_length = kernel_length * d->phases;
+    double *prototype = calloc(prototype_length, sizeof(double));
+    _nrf_fir_low_pass(filter_freq / ((double) in_rate * d->phases), prototype_length, prototype);
+    d->coefficients = calloc(d->taps * d->phases, sizeof(float));
+    for (int p = 0; p < d->phases; p++) {
+        for (int k = 0; k < kernel_length; k++) {
+            d->coefficients[p * d->taps + d->taps - 1 - k] = prototype[p + k * d->phases] * d->phases;
+        }
+    }
+    free(prototype);
+
+    // The last taps - 1 samples of the previous block come before the new
+    // ones, so every output reads one contiguous window.
+    d->samples_capacity = d->taps - 1;
+    d->samples = calloc(d->samples_capacity, sizeof(float));
     return d;
 }
 
 void nrf_downsampler_process(nrf_downsampler *d, double *samples, int length) {
-    nrf_fir_filter_load(d->filter, samples, length);
+    int capacity = (int) ((int64_t) length * d->interpolation / d->decimation) + 2;
+    if (capacity > d->out_capacity) {
+        free(d->out_samples);
+        d->out_samples = calloc(capacity, sizeof(double));
+        d->out_capacity = capacity;
+    }
 
-    // FIXME: Optimize by comparing out_length to d->out_length
-    free(d->out_samples);
-    d->out_length = floor(length / d->rate_mul);
-    d->out_samples = calloc(d->out_length, sizeof(double));
+    const int taps = d->taps;
+    const int history = taps - 1;
+    if (history + length > d->samples_capacity) {
+        d->samples = realloc(d->samples, (history + length) * sizeof(float));
+        d->samples_capacity = history + length;
+    }
+    float *x = d->samples;
+    for (int i = 0; i < length; i++) {
+        x[history + i] = samples[i];
+    }
 
-    double t = 0;
-    for (int i = 0; i < d->out_length; i++) {
-        d->out_samples[i] = nrf_fir_filter_get(d->filter, floor(t));
-        t += d->rate_mul;
+    // next is the time of the next output, in units of 1 / L samples after
+    // input sample i. The output at input i uses x[i] up to x[i + history].
+    // With fewer phases than L, the phase is rounded to the nearest one.
+    // Rounding up past the last phase means phase 0 of the next input; if
+    // that input isn't here yet, the output waits for the next block, and
+    // next_output is just below 0.
+    const int interpolation = d->interpolation;
+    int next = d->next_output;
+    int i = next >= 0 ? next / interpolation : -((interpolation - 1 - next) / interpolation);
+    next -= i * interpolation;
+    int n = 0;
+    for (;;) {
+        int phase = (int) (((int64_t) next * d->phases + interpolation / 2) / interpolation);
+        int at = i;
+        if (phase == d->phases) {
+            phase = 0;
+            at++;
+        }
+        if (at >= length) break;
+        d->out_samples[n++] = nrf_fir_dot_f32(d->coefficients + phase * taps, x + at, taps);
+        next += d->decimation;
+        int advance = next / interpolation;
+        i += advance;
+        next -= advance * interpolation;
     }
+    d->next_output = next + (i - length) * interpolation;
+    d->out_length = n;
+    memmove(x, x + length, history * sizeof(float));
 }
 
 void nrf_downsampler_free(nrf_downsampler *d) {
-    nrf_fir_filter_free(d->filter);
+    free(d->coefficients);
+    free(d->samples);
     free(d->out_samples);
     free(d);
 }
 
+// Demodulator front end
+
+// A downsampler whose kernel is just long enough for the given transition
+// width. The window of _nrf_fir_low_pass needs about 5.5 / transition taps.
+static nrf_downsampler *_nrf_downsampler_new_with_transition(int in_rate, int out_rate, int filter_freq, double transition) {
+    int kernel_length = (int) ceil(5.5 * in_rate / transition) | 1;
+    kernel_length = kernel_length < 11 ? 11 : kernel_length > NRF_FRONT_END_MAX_TAPS ? NRF_FRONT_END_MAX_TAPS : kernel_length;
+    return nrf_downsampler_new(in_rate, out_rate, filter_freq, kernel_length);
+}
+
+// The rough cost of a downsampler per input sample, in units of one tap.
+// Copying an input sample costs about 10 taps, and every output pays about
+// 120 taps on top of its kernel for the call and the horizontal sum.
+static double _nrf_downsampler_cost(int in_rate, int out_rate, double transition) {
+    return 10 + (120 + 5.5 * in_rate / transition) * out_rate / in_rate;
+}
+
+static int _nrf_downsampler_fits(int in_rate, double transition) {
+    return 5.5 * in_rate / transition <= NRF_FRONT_END_MAX_TAPS;
+}
+
+typedef struct {
+    int fits;
+    double cost;
+    int decimations[NRF_FRONT_END_MAX_STAGES];
+} _nrf_front_end_plan;
+
+static int _nrf_front_end_plan_better(const _nrf_front_end_plan *a, const _nrf_front_end_plan *b) {
+    return a->fits > b->fits || (a->fits == b->fits && a->cost < b->cost);
+}
+
+// Find the cheapest way to get from rate to out_rate in at most
+// max_stages stages. All but the last stage decimate by an integer factor.
+static _nrf_front_end_plan _nrf_front_end_find_plan(int rate, int out_rate, int bandwidth, double transition, int max_stages) {
+    _nrf_front_end_plan best;
+    memset(&best, 0, sizeof(best));
+    best.fits = _nrf_downsampler_fits(rate, transition);
+    best.cost = _nrf_downsampler_cost(rate, out_rate, transition);
+    if (max_stages == 1) {
+        return best;
+    }
+    for (int decimation = 2; rate / decimation >= out_rate * 2; decimation++) {
+        if (rate % decimation != 0) {
+            continue;
+        }
+        int next_rate = rate / decimation;
+        double coarse_transition = next_rate - 2.0 * bandwidth;
+        _nrf_front_end_plan rest = _nrf_front_end_find_plan(next_rate, out_rate, bandwidth, transition, max_stages - 1);
+        _nrf_front_end_plan plan;
+        plan.fits = rest.fits && _nrf_downsampler_fits(rate, coarse_transition);
+        plan.cost = _nrf_downsampler_cost(rate, next_rate, coarse_transition) + rest.cost / decimation;
+        plan.decimations[0] = decimation;
+        memcpy(plan.decimations + 1, rest.decimations, (NRF_FRONT_END_MAX_STAGES - 1) * sizeof(int));
+        if (_nrf_front_end_plan_better(&plan, &best)) {
+            best = plan;
+        }
+    }
+    return best;
+}
+
+// The coarse stages decimate by integer factors. They only have to keep
+// what would alias into the channel away, so their transition bands are
+// wide and their kernels short. The last stage then cuts out the channel at
+// a low rate. The cascade with the lowest estimated cost wins, as long as
+// all kernels fit in NRF_FRONT_END_MAX_TAPS; for small ratios that is a
+// single stage.
+nrf_front_end *nrf_front_end_new(int in_rate, int out_rate, int bandwidth) {
+    nrf_front_end *fe = calloc(1, sizeof(nrf_front_end));
+    if (bandwidth * 5 > out_rate * 2) {
+        bandwidth = out_rate * 2 / 5;
+    }
+    fe->in_rate = in_rate;
+    fe->out_rate = out_rate;
+    fe->bandwidth = bandwidth;
+
+    // Keep the passband flat, but don't let the stopband alias back into it.
+    double transition = bandwidth;
+    if (transition > 2.0 * (out_rate - 2 * bandwidth)) {
+        transition = 2.0 * (out_rate - 2 * bandwidth);
+    }
+
+    _nrf_front_end_plan plan = _nrf_front_end_find_plan(in_rate, out_rate, bandwidth, transition, NRF_FRONT_END_MAX_STAGES);
+    int rate = in_rate;
+    for (int i = 0; i < NRF_FRONT_END_MAX_STAGES - 1 && plan.decimations[i] > 1; i++) {
+        int next_rate = rate / plan.decimations[i];
+        double coarse_transition = next_rate - 2.0 * bandwidth;
+        fe->stages_i[fe->n_stages] = _nrf_downsampler_new_with_transition(rate, next_rate, next_rate / 2, coarse_transition);
+        fe->stages_q[fe->n_stages] = _nrf_downsampler_new_with_transition(rate, next_rate, next_rate / 2, coarse_transition);
+        fe->n_stages++;
+        rate = next_rate;
+    }
+    fe->stages_i[fe->n_stages] = _nrf_downsampler_new_with_transition(rate, out_rate, bandwidth, transition);
+    fe->stages_q[fe->n_stages] = _nrf_downsampler_new_with_transition(rate, out_rate, bandwidth, transition);
+    fe->n_stages++;
+    return fe;
+}
+
+void nrf_front_end_process(nrf_front_end *fe, double *samples_i, double *samples_q, int length) {
+    for (int i = 0; i < fe->n_stages; i++) {
+        nrf_downsampler_process(fe->stages_i[i], samples_i, length);
+        nrf_downsampler_process(fe->stages_q[i], samples_q, length);
+        samples_i = fe->stages_i[i]->out_samples;
+        samples_q = fe->stages_q[i]->out_samples;
+        length = fe->stages_i[i]->out_length;
+    }
+    fe->out_i = samples_i;
+    fe->out_q = samples_q;
+    fe->out_length = length;
+}
+
+void nrf_front_end_free(nrf_front_end *fe) {
+    for (int i = 0; i < fe->n_stages; i++) {
+        nrf_downsampler_free(fe->stages_i[i]);
+        nrf_downsampler_free(fe->stages_q[i]);
+    }
+    free(fe);
+}
+
 // Frequency shifter
 
-nrf_freq_shifter *nrf_freq_shifter_new(int freq_offset, int sample_rate) {
-    nrf_freq_shifter *shifter = calloc(1, sizeof(nrf_freq_shifter));
-    nrf_block_init(&shifter->block, NRF_BLOCK_GENERIC, (nrf_block_process_fn) nrf_freq_shifter_process, (nrf_block_result_fn) nrf_freq_shifter_get_buffer);
-    shifter->freq_offset = freq_offset;
-    shifter->sample_rate = sample_rate;
-    shifter->cosine = 1;
-    shifter->sine = 0;
-    return shifter;
+// Takes effect at the next block, continuing from the current phase.
+void nrf_freq_shifter_set_freq_offset(nrf_freq_shifter *shifter, int freq_offset) {
+    NUT_ATOMIC_STORE_RELAXED(&shifter->freq_offset, freq_offset);
+}
+
+// The oscillator's phase is a 64-bit accumulator, so it never drifts. It
+// runs NRF_NCO_LANES phasors side by side, each advancing NRF_NCO_LANES
+// samples per step. Every NRF_NCO_CHUNK samples the phasors are computed
+// again from the accumulator, which keeps their amplitude at 1.
+static uint64_t _nrf_nco_mix(uint64_t phase, uint64_t step, double *samples_i, double *samples_q, int stride, int length, double bias) {
+    const double phase_scale = TAU / 18446744073709551616.0;
+    double step_cos = cos((uint64_t) (step * NRF_NCO_LANES) * phase_scale);
+    double step_sin = sin((uint64_t) (step * NRF_NCO_LANES) * phase_scale);
+    for (int start = 0; start < length; start += NRF_NCO_CHUNK) {
+        int end = start + NRF_NCO_CHUNK < length ? start + NRF_NCO_CHUNK : length;
+        double c[NRF_NCO_LANES], s[NRF_NCO_LANES];
+        for (int j = 0; j < NRF_NCO_LANES; j++) {
+            double angle = (uint64_t) (phase + step * j) * phase_scale;
+            c[j] = cos(angle);
+            s[j] = sin(angle);
+        }
+        int i = start;
+        for (; i + NRF_NCO_LANES <= end; i += NRF_NCO_LANES) {
+            for (int j = 0; j < NRF_NCO_LANES; j++) {
+                double vi = samples_i[(i + j) * stride];
+                double vq = samples_q[(i + j) * stride];
+                samples_i[(i + j) * stride] = vi * c[j] - vq * s[j] + bias;
+                samples_q[(i + j) * stride] = vi * s[j] + vq * c[j] + bias;
+            }
+            for (int j = 0; j < NRF_NCO_LANES; j++) {
+                double new_c = c[j] * step_cos - s[j] * step_sin;
+                s[j] = c[j] * step_sin + s[j] * step_cos;
+                c[j] = new_c;
+            }
+        }
+        for (int j = 0; i < end; i++, j++) {
+            double vi = samples_i[i * stride];
+            double vq = samples_q[i * stride];
+            samples_i[i * stride] = vi * c[j] - vq * s[j] + bias;
+            samples_q[i * stride] = vi * s[j] + vq * c[j] + bias;
+        }
+        phase += step * (uint64_t) (end - start);
+    }
+    return phase;
+}
+
+// The phase step of a frequency, in 1 / 2^64 cycles per sample.
+static uint64_t _nrf_nco_step(double freq, int sample_rate) {
+    double cycles = freq / sample_rate;
+    cycles -= floor(cycles);
+    return cycles < 1 ? (uint64_t) (cycles * 18446744073709551616.0) : 0;
+}
+
+static uint64_t _nrf_freq_shifter_step(nrf_freq_shifter *shifter) {
+    int freq_offset = NUT_ATOMIC_LOAD_RELAXED(&shifter->freq_offset);
+    return _nrf_nco_step(freq_offset, shifter->sample_rate);
 }
 
 void nrf_freq_shifter_process_samples(nrf_freq_shifter *shifter, double *samples_i, double *samples_q, int length) {
-    double delta_cos = cos(TAU * shifter->freq_offset / (double) shifter->sample_rate);
-    double delta_sin = sin(TAU * shifter->freq_offset / (double) shifter->sample_rate);
-    double cosine = shifter->cosine;
-    double sine = shifter->sine;
-    for (int i = 0; i < length; i++) {
-        double vi = samples_i[i];
-        double vq = samples_q[i];
-        samples_i[i] = vi * cosine - vq * sine;
-        samples_q[i] = vi * sine + vq * cosine;
-        double new_sine = cosine * delta_sin + sine * delta_cos;
-        double new_cosine = cosine * delta_cos - sine * delta_sin;
-        sine = new_sine;
-        cosine = new_cosine;
-    }
-    shifter->cosine = cosine;
-    shifter->sine = sine;
+    uint64_t step = _nrf_freq_shifter_step(shifter);
+    shifter->phase = _nrf_nco_mix(shifter->phase, step, samples_i, samples_q, 1, length, 0);
 }
 
-void nrf_freq_shifter_process(nrf_freq_shifter *shifter, nut_buffer *buffer) {
-    double delta_cos = cos(TAU * shifter->freq_offset / (double) shifter->sample_rate);
-    double delta_sin = sin(TAU * shifter->freq_offset / (double) shifter->sample_rate);
-    double cosine = shifter->cosine;
-    double sine = shifter->sine;
+static void _nrf_freq_shifter_shift(nrf_freq_shifter *shifter, nut_buffer *buffer, int may_modify) {
     assert(buffer->channels == 2);
-    int size = buffer->length * buffer->channels;
-    if (shifter->buffer == NULL) {
-        shifter->buffer = nut_buffer_new_f64(size, 2, NULL);
+    if (may_modify && buffer->type == NUT_BUFFER_F64 && nut_buffer_is_writable(buffer)) {
+        // Nothing else sees the input, so shift it in place and publish it.
+        if (shifter->buffer != NULL) {
+            nut_buffer_release(shifter->buffer);
+        }
+        shifter->buffer = nut_buffer_copy(buffer);
+    } else {
+        if (shifter->buffer == NULL || shifter->buffer->length != buffer->length) {
+            if (shifter->buffer != NULL) {
+                nut_buffer_release(shifter->buffer);
+            }
+            shifter->buffer = nut_buffer_new_f64(buffer->length, 2, NULL);
+        }
+        nut_buffer_make_writable(shifter->buffer);
+        nut_buffer_read_f64(buffer, 0, buffer->length * 2, shifter->buffer->data.f64);
     }
     double *out_samples = shifter->buffer->data.f64;
-    for (int i = 0; i < size; i += 2) {
-        double vi = nut_buffer_get_f64(buffer, i);
-        double vq = nut_buffer_get_f64(buffer, i + 1);
-        out_samples[i] = vi * cosine - vq * sine + 0.5;
-        out_samples[i + 1] = vi * sine + vq * cosine + 0.5;
-        double new_sine = cosine * delta_sin + sine * delta_cos;
-        double new_cosine = cosine * delta_cos - sine * delta_sin;
-        sine = new_sine;
-        cosine = new_cosine;
-    }
-    shifter->cosine = cosine;
-    shifter->sine = sine;
+    uint64_t step = _nrf_freq_shifter_step(shifter);
+    shifter->phase = _nrf_nco_mix(shifter->phase, step, out_samples, out_samples + 1, 2, buffer->length, 0.5);
+}
+
+// The input is left alone; the result is in the shifter's own buffer.
+void nrf_freq_shifter_process(nrf_freq_shifter *shifter, nut_buffer *buffer) {
+    _nrf_freq_shifter_shift(shifter, buffer, 0);
+}
+
+// As a block, the input is handed over by nrf_block_process, so it can be
+// shifted in place if nothing else shares it.
+static void _nrf_freq_shifter_block_process(nrf_freq_shifter *shifter, nut_buffer *buffer) {
+    _nrf_freq_shifter_shift(shifter, buffer, 1);
+}
+
+nrf_freq_shifter *nrf_freq_shifter_new(int freq_offset, int sample_rate) {
+    nrf_freq_shifter *shifter = calloc(1, sizeof(nrf_freq_shifter));
+    nrf_block_init(&shifter->block, NRF_BLOCK_GENERIC, (nrf_block_process_fn) _nrf_freq_shifter_block_process, (nrf_block_result_fn) nrf_freq_shifter_get_buffer);
+    shifter->freq_offset = freq_offset;
+    shifter->sample_rate = sample_rate;
+    return shifter;
 }
 
 nut_buffer *nrf_freq_shifter_get_buffer(nrf_freq_shifter *shifter) {
+    if (shifter->buffer == NULL) {
+        return nut_buffer_new_f64(0, 2, NULL);
+    }
     return nut_buffer_copy(shifter->buffer);
 }
 
 void nrf_freq_shifter_free(nrf_freq_shifter *shifter) {
+    nrf_block_deinit(&shifter->block);
+    if (shifter->buffer != NULL) {
+        nut_buffer_release(shifter->buffer);
+    }
     free(shifter);
 }
 
@@ -877,27 +2672,192 @@ void nrf_freq_shifter_free(nrf_freq_shifter *shifter) {
 
 nrf_signal_detector *nrf_signal_detector_new() {
     nrf_signal_detector *detector = calloc(1, sizeof(nrf_signal_detector));
+    nrf_block_init(&detector->block, NRF_BLOCK_SINK, (nrf_block_process_fn) nrf_signal_detector_process, NULL);
+    pthread_mutex_init(&detector->stats_mutex, NULL);
     return detector;
 }
 
+// Welford's update, applied to chunks instead of single values: each chunk
+// is summed relative to its first value, which keeps the sums small, and
+// then merged into the running mean and sum of squared differences.
 void nrf_signal_detector_process(nrf_signal_detector *detector, nut_buffer *buffer) {
     int size = buffer->length * buffer->channels;
-    double total = 0;
-    for (int i = 0; i < size; i += 2) {
-        total += nut_buffer_get_f64(buffer, i);
+    double values[NRF_SIGNAL_DETECTOR_CHUNK];
+    int64_t count = 0;
+    double mean = 0;
+    double m2 = 0;
+    double sum_squares = 0;
+    double peak = 0;
+    for (int start = 0; start < size; start += NRF_SIGNAL_DETECTOR_CHUNK) {
+        int n = size - start < NRF_SIGNAL_DETECTOR_CHUNK ? size - start : NRF_SIGNAL_DETECTOR_CHUNK;
+        nut_buffer_read_f64(buffer, start, n, values);
+        double shift = values[0];
+        double s1 = 0;
+        double s2 = 0;
+        for (int i = 0; i < n; i++) {
+            double v = values[i];
+            double d = v - shift;
+            s1 += d;
+            s2 += d * d;
+            sum_squares += v * v;
+            peak = fabs(v) > peak ? fabs(v) : peak;
+        }
+        double chunk_mean = shift + s1 / n;
+        double chunk_m2 = s2 - s1 * s1 / n;
+        double delta = chunk_mean - mean;
+        int64_t total = count + n;
+        mean += delta * n / total;
+        m2 += chunk_m2 + delta * delta * ((double) count * n / total);
+        count = total;
     }
 
-    double mean = total / (double) size * 2;
-    double diffs_total = 0;
-    for (int i = 0; i < size; i++) {
-        double diff = nut_buffer_get_f64(buffer, i) - mean;
-        diffs_total += diff * diff;
+    nrf_signal_stats stats;
+    memset(&stats, 0, sizeof(nrf_signal_stats));
+    if (count > 0) {
+        stats.count = count;
+        stats.mean = mean;
+        stats.variance = m2 > 0 ? m2 / count : 0;
+        stats.standard_deviation = sqrt(stats.variance);
+        stats.peak = peak;
+        stats.rms = sqrt(sum_squares / count);
+        stats.crest_factor = stats.rms > 0 ? peak / stats.rms : 0;
     }
-    detector->mean = mean;
-    detector->standard_deviation = sqrt(diffs_total / mean);
+    pthread_mutex_lock(&detector->stats_mutex);
+    detector->stats = stats;
+    pthread_mutex_unlock(&detector->stats_mutex);
+}
+
+// The statistics of the last buffer.
+nrf_signal_stats nrf_signal_detector_get_stats(nrf_signal_detector *detector) {
+    pthread_mutex_lock(&detector->stats_mutex);
+    nrf_signal_stats stats = detector->stats;
+    pthread_mutex_unlock(&detector->stats_mutex);
+    return stats;
 }
 
 void nrf_signal_detector_free(nrf_signal_detector *detector) {
+    nrf_block_deinit(&detector->block);
+    pthread_mutex_destroy(&detector->stats_mutex);
+    free(detector);
+}
+
+// Carrier Detector
+
+nrf_carrier_detector *nrf_carrier_detector_new(nrf_carrier_detector_config config) {
+    nrf_carrier_detector *detector = calloc(1, sizeof(nrf_carrier_detector));
+    nrf_block_init(&detector->block, NRF_BLOCK_SINK, (nrf_block_process_fn) nrf_carrier_detector_process, NULL);
+    if (config.fft_size <= 0) {
+        config.fft_size = DEFAULT_FFT_SIZE;
+    }
+    if (config.guard_cells <= 0) {
+        config.guard_cells = NRF_CARRIER_DETECTOR_DEFAULT_GUARD_CELLS;
+    }
+    if (config.training_cells <= 0) {
+        config.training_cells = NRF_CARRIER_DETECTOR_DEFAULT_TRAINING_CELLS;
+    }
+    detector->config = config;
+    detector->power = calloc(config.fft_size, sizeof(double));
+    detector->sums = calloc(config.fft_size + 1, sizeof(double));
+    pthread_mutex_init(&detector->carriers_mutex, NULL);
+    return detector;
+}
+
+static int _nrf_carrier_compare_bin(const void *a, const void *b) {
+    return ((const nrf_carrier *) a)->bin - ((const nrf_carrier *) b)->bin;
+}
+
+// Adds the carrier, replacing the weakest one if the list is full.
+static int _nrf_carrier_add(nrf_carrier *carriers, int n_carriers, nrf_carrier carrier) {
+    if (n_carriers < NRF_CARRIER_DETECTOR_MAX_CARRIERS) {
+        carriers[n_carriers] = carrier;
+        return n_carriers + 1;
+    }
+    int weakest = 0;
+    for (int i = 1; i < n_carriers; i++) {
+        if (carriers[i].power_db < carriers[weakest].power_db) {
+            weakest = i;
+        }
+    }
+    if (carrier.power_db > carriers[weakest].power_db) {
+        carriers[weakest] = carrier;
+    }
+    return n_carriers;
+}
+
+// Takes fft_size values, lowest frequency first. The noise level of each
+// bin comes from a running sum, so the cost doesn't depend on the number of
+// training cells. At the edges, only the cells on one side are used.
+void nrf_carrier_detector_process_line(nrf_carrier_detector *detector, const float *line) {
+    const int size = detector->config.fft_size;
+    const int guard = detector->config.guard_cells;
+    const int training = detector->config.training_cells;
+    const double threshold = pow(10, detector->config.threshold_db / 10);
+    double *power = detector->power;
+    double *sums = detector->sums;
+    sums[0] = 0;
+    for (int i = 0; i < size; i++) {
+        power[i] = detector->config.input_db ? exp(line[i] * (M_LN10 / 10)) : (double) line[i] * line[i];
+        sums[i + 1] = sums[i] + power[i];
+    }
+
+    nrf_carrier carriers[NRF_CARRIER_DETECTOR_MAX_CARRIERS];
+    int n_carriers = 0;
+    for (int i = 0; i < size; i++) {
+        // The first of the highest bins in the guard region
+        int is_peak = 1;
+        for (int j = i - guard; j <= i + guard && is_peak; j++) {
+            if (j < 0 || j >= size || j == i) continue;
+            is_peak = j < i ? power[j] < power[i] : power[j] <= power[i];
+        }
+        if (!is_peak) continue;
+
+        int left_start = i - guard - training > 0 ? i - guard - training : 0;
+        int left_end = i - guard > 0 ? i - guard : 0;
+        int right_start = i + guard + 1 < size ? i + guard + 1 : size;
+        int right_end = i + guard + 1 + training < size ? i + guard + 1 + training : size;
+        int cells = (left_end - left_start) + (right_end - right_start);
+        if (cells == 0) continue;
+        double noise = (sums[left_end] - sums[left_start] + sums[right_end] - sums[right_start]) / cells;
+        if (power[i] > noise * threshold) {
+            nrf_carrier carrier;
+            carrier.bin = i;
+            carrier.power_db = 10 * log10(power[i] + 1e-20);
+            carrier.snr_db = 10 * log10(power[i] / (noise + 1e-20));
+            n_carriers = _nrf_carrier_add(carriers, n_carriers, carrier);
+        }
+    }
+
+    qsort(carriers, n_carriers, sizeof(nrf_carrier), _nrf_carrier_compare_bin);
+    pthread_mutex_lock(&detector->carriers_mutex);
+    memcpy(detector->carriers, carriers, n_carriers * sizeof(nrf_carrier));
+    detector->n_carriers = n_carriers;
+    pthread_mutex_unlock(&detector->carriers_mutex);
+}
+
+// Takes a spectrum line, as published by a connected nrf_fft or returned
+// by nrf_fft_get_line. Longer buffers only have their first line used.
+void nrf_carrier_detector_process(nrf_carrier_detector *detector, nut_buffer *buffer) {
+    assert(buffer->type == NUT_BUFFER_F32);
+    assert(buffer->length * buffer->channels >= detector->config.fft_size);
+    nrf_carrier_detector_process_line(detector, buffer->data.f32);
+}
+
+// Copies the carriers found in the last line, at most max_carriers, and
+// returns their number. They are sorted by bin. If there were more than
+// NRF_CARRIER_DETECTOR_MAX_CARRIERS, only the strongest are kept.
+int nrf_carrier_detector_get_carriers(nrf_carrier_detector *detector, nrf_carrier *carriers, int max_carriers) {
+    pthread_mutex_lock(&detector->carriers_mutex);
+    int n = detector->n_carriers < max_carriers ? detector->n_carriers : max_carriers;
+    memcpy(carriers, detector->carriers, n * sizeof(nrf_carrier));
+    pthread_mutex_unlock(&detector->carriers_mutex);
+    return n;
+}
+
+void nrf_carrier_detector_free(nrf_carrier_detector *detector) {
+    nrf_block_deinit(&detector->block);
+    pthread_mutex_destroy(&detector->carriers_mutex);
+    free(detector->power);
+    free(detector->sums);
     free(detector);
 }
 
@@ -930,29 +2890,128 @@ void nrf_raw_demodulator_free(nrf_raw_demodulator *demodulator) {
     free(demodulator);
 }
 
+// FM discriminator
+
+// Branch-free atan2, accurate to about 2e-4 radians. Written with selects
+// only, so the compiler can vectorize loops that use it.
+static inline double _nrf_atan2(double y, double x) {
+    double ax = fabs(x);
+    double ay = fabs(y);
+    double mx = ax > ay ? ax : ay;
+    double mn = ax > ay ? ay : ax;
+    // Adding DBL_MIN keeps 0 / 0 at 0 without a branch.
+    double a = mn / (mx + DBL_MIN);
+    double s = a * a;
+    double r = ((-0.0464964749 * s + 0.15931422) * s - 0.327622764) * s * a + a;
+    r = ay > ax ? M_PI / 2 - r : r;
+    r = x < 0 ? M_PI - r : r;
+    return y < 0 ? -r : r;
+}
+
+// The phase difference between each sample and the one before it. The
+// first sample is compared with last, which is updated for the next block.
+static inline void _nrf_fm_discriminate_body(const double *restrict samples_i, const double *restrict samples_q, const int stride, int length, double *last, double gain, double *restrict out) {
+    if (length == 0) {
+        return;
+    }
+    double i0 = samples_i[0];
+    double q0 = samples_q[0];
+    out[0] = _nrf_atan2(last[0] * q0 - i0 * last[1], last[0] * i0 + last[1] * q0) * gain;
+    for (int k = 1; k < length; k++) {
+        double pi = samples_i[(k - 1) * stride];
+        double pq = samples_q[(k - 1) * stride];
+        double ci = samples_i[k * stride];
+        double cq = samples_q[k * stride];
+        out[k] = _nrf_atan2(pi * cq - ci * pq, pi * ci + pq * cq) * gain;
+    }
+    last[0] = samples_i[(length - 1) * stride];
+    last[1] = samples_q[(length - 1) * stride];
+}
+
+typedef void (*_nrf_fm_discriminate_fn)(const double *samples_i, const double *samples_q, int stride, int length, double *last, double gain, double *out);
+
+// The constant strides let the compiler vectorize the separate and the
+// interleaved case.
+static void _nrf_fm_discriminate_default(const double *samples_i, const double *samples_q, int stride, int length, double *last, double gain, double *out) {
+    if (stride == 1) {
+        _nrf_fm_discriminate_body(samples_i, samples_q, 1, length, last, gain, out);
+    } else if (stride == 2) {
+        _nrf_fm_discriminate_body(samples_i, samples_q, 2, length, last, gain, out);
+    } else {
+        _nrf_fm_discriminate_body(samples_i, samples_q, stride, length, last, gain, out);
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+__attribute__((target("avx2,fma")))
+static void _nrf_fm_discriminate_avx2(const double *samples_i, const double *samples_q, int stride, int length, double *last, double gain, double *out) {
+    if (stride == 1) {
+        _nrf_fm_discriminate_body(samples_i, samples_q, 1, length, last, gain, out);
+    } else if (stride == 2) {
+        _nrf_fm_discriminate_body(samples_i, samples_q, 2, length, last, gain, out);
+    } else {
+        _nrf_fm_discriminate_body(samples_i, samples_q, stride, length, last, gain, out);
+    }
+}
+
+#endif
+
+static _nrf_fm_discriminate_fn _nrf_fm_discriminate = _nrf_fm_discriminate_default;
+static pthread_once_t _nrf_fm_discriminate_once = PTHREAD_ONCE_INIT;
+
+static void _nrf_fm_select_discriminator() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        _nrf_fm_discriminate = _nrf_fm_discriminate_avx2;
+    }
+#endif
+}
+
+// Polar FM discriminator: out[k] is the phase step from sample k - 1 to k,
+// in radians, times gain. I and Q are either separate arrays (stride 1) or
+// interleaved (stride 2, samples_q = samples_i + 1). last holds the I and
+// Q of the sample before the first one, and is updated.
+void nrf_fm_discriminate(const double *samples_i, const double *samples_q, int stride, int length, double *last, double gain, double *out) {
+    pthread_once(&_nrf_fm_discriminate_once, _nrf_fm_select_discriminator);
+    _nrf_fm_discriminate(samples_i, samples_q, stride, length, last, gain, out);
+}
+
 // FM Demodulator
 
+// Broadcast FM: 75 kHz deviation, 50 us de-emphasis.
+static const nrf_fm_config WBFM_CONFIG = {336000, 60000, 75000, 10000, 50};
+
+// Narrowband FM, as used on 12.5 kHz channels: 2.5 kHz deviation.
+static const int NBFM_BANDWIDTH = 6000;
+static const int NBFM_MAX_DEVIATION = 2500;
+static const int NBFM_AUDIO_FREQ = 3000;
+
 nrf_fm_demodulator *nrf_fm_demodulator_new(int in_sample_rate, int out_sample_rate) {
+    return nrf_fm_demodulator_new_with_config(in_sample_rate, out_sample_rate, WBFM_CONFIG);
+}
+
+nrf_fm_demodulator *nrf_fm_demodulator_new_with_config(int in_sample_rate, int out_sample_rate, const nrf_fm_config config) {
     nrf_fm_demodulator *d = calloc(1, sizeof(nrf_fm_demodulator));
-    const int inter_rate = 336000;
-    const int  max_f = 75000;
-    const double filter_freq = max_f * 0.8;
     d->in_sample_rate = in_sample_rate;
     d->out_sample_rate = out_sample_rate;
-    d->ampl_conv = out_sample_rate / (TAU * max_f);
-    d->downsampler_i = nrf_downsampler_new(in_sample_rate, inter_rate, filter_freq, 51);
-    d->downsampler_q = nrf_downsampler_new(in_sample_rate, inter_rate, filter_freq, 51);
-    d->downsampler_audio = nrf_downsampler_new(inter_rate, out_sample_rate, 10000, 41);
+    // Full deviation gives full-scale audio.
+    d->ampl_conv = config.inter_rate / (TAU * config.max_deviation);
+    d->deemphasis_alpha = config.deemphasis_us > 0 ? 1.0 / (1.0 + out_sample_rate * config.deemphasis_us / 1e6) : 1;
+    d->front_end = nrf_front_end_new(in_sample_rate, config.inter_rate, config.bandwidth);
+    double audio_transition = config.audio_freq / 2.0;
+    d->downsampler_audio = _nrf_downsampler_new_with_transition(config.inter_rate, out_sample_rate, config.audio_freq, audio_transition);
     return d;
 }
 
 void nrf_fm_demodulator_process(nrf_fm_demodulator *demodulator, double *samples_i, double *samples_q, int length) {
-    // Downsample
-    nrf_downsampler_process(demodulator->downsampler_i, samples_i, length);
-    nrf_downsampler_process(demodulator->downsampler_q, samples_q, length);
+    // Filter and downsample
+    nrf_front_end *fe = demodulator->front_end;
+    nrf_front_end_process(fe, samples_i, samples_q, length);
 
     // Allocate demodulated samples buffer
-    int demodulated_length = demodulator->downsampler_i->out_length;
+    int demodulated_length = fe->out_length;
     if (demodulated_length != demodulator->demodulated_length) {
         free(demodulator->demodulated_samples);
         demodulator->demodulated_samples = calloc(demodulated_length, sizeof(double));
@@ -961,42 +3020,10 @@ void nrf_fm_demodulator_process(nrf_fm_demodulator *demodulator, double *samples
     double *demodulated_samples = demodulator->demodulated_samples;
 
     // Actual FM demodulation
-    double prev = 0;
-    double delta_sum_squared = 0;
-    double l_i = demodulator->l_i;
-    double l_q = demodulator->l_q;
-    for (int i = 0; i < demodulated_length; i++) {
-        double real = l_i * demodulator->downsampler_i->out_samples[i] + l_q * demodulator->downsampler_q->out_samples[i];
-        double imag = l_i * demodulator->downsampler_q->out_samples[i] - demodulator->downsampler_i->out_samples[i] * l_q;
-        double sgn = 1;
-        if (imag < 0) {
-            sgn *= -1;
-            imag *= -1;
-        }
-        double ang = 0;
-        double div;
-        if (real == imag) {
-            div = 1;
-        } else if (real > imag) {
-            div = imag / real;
-        } else {
-            ang = -M_PI / 2;
-            div = real / imag;
-            sgn *= -1;
-        }
-        demodulated_samples[i] = sgn *
-            (ang + div
-                / (0.98419158358617365
-                    + div * (0.093485702629671305
-                        + div * 0.19556307900617517))) * demodulator->ampl_conv;
-        l_i = demodulator->downsampler_i->out_samples[i];
-        l_q = demodulator->downsampler_q->out_samples[i];
-        double delta = prev - demodulated_samples[i];
-        delta_sum_squared += delta * delta;
-        prev = demodulated_samples[i];
-    }
-    demodulator->l_i = l_i;
-    demodulator->l_q = l_q;
+    double last[2] = { demodulator->l_i, demodulator->l_q };
+    nrf_fm_discriminate(fe->out_i, fe->out_q, 1, demodulated_length, last, demodulator->ampl_conv, demodulated_samples);
+    demodulator->l_i = last[0];
+    demodulator->l_q = last[1];
 
     // Downsample again, for audio
     nrf_downsampler_process(demodulator->downsampler_audio, demodulated_samples, demodulated_length);
@@ -1012,7 +3039,7 @@ void nrf_fm_demodulator_process(nrf_fm_demodulator *demodulator, double *samples
     double *audio_samples = demodulator->audio_samples;
 
     // De-emphasize samples
-    double alpha = 1.0 / (1.0 + demodulator->out_sample_rate * 50.0 / 1e6);
+    double alpha = demodulator->deemphasis_alpha;
     double val = demodulator->deemphasis_val;
     for (int i = 0; i < audio_samples_length; i++) {
         val = val + alpha * (audio_samples[i] - val);
@@ -1022,14 +3049,109 @@ void nrf_fm_demodulator_process(nrf_fm_demodulator *demodulator, double *samples
 }
 
 void nrf_fm_demodulator_free(nrf_fm_demodulator *demodulator) {
-    nrf_downsampler_free(demodulator->downsampler_i);
-    nrf_downsampler_free(demodulator->downsampler_q);
+    nrf_front_end_free(demodulator->front_end);
     nrf_downsampler_free(demodulator->downsampler_audio);
     free(demodulator->demodulated_samples);
     free(demodulator->audio_samples);
     free(demodulator);
 }
 
+// AM Demodulator
+
+static const int AM_BANDWIDTH = 5000;
+
+// Removes the carrier, which shows up as DC after envelope detection.
+static const double AM_DC_SECONDS = 0.05;
+
+// The front end filters straight to the audio rate, so the channel filter
+// also limits the audio.
+nrf_am_demodulator *nrf_am_demodulator_new(int in_sample_rate, int out_sample_rate) {
+    nrf_am_demodulator *d = calloc(1, sizeof(nrf_am_demodulator));
+    d->in_sample_rate = in_sample_rate;
+    d->out_sample_rate = out_sample_rate;
+    d->front_end = nrf_front_end_new(in_sample_rate, out_sample_rate, AM_BANDWIDTH);
+    return d;
+}
+
+static void _nrf_audio_samples_reserve(double **audio_samples, int *audio_samples_length, int length) {
+    if (length != *audio_samples_length) {
+        free(*audio_samples);
+        *audio_samples = calloc(length, sizeof(double));
+        *audio_samples_length = length;
+    }
+}
+
+void nrf_am_demodulator_process(nrf_am_demodulator *demodulator, double *samples_i, double *samples_q, int length) {
+    nrf_front_end *fe = demodulator->front_end;
+    nrf_front_end_process(fe, samples_i, samples_q, length);
+    _nrf_audio_samples_reserve(&demodulator->audio_samples, &demodulator->audio_samples_length, fe->out_length);
+
+    double alpha = 1.0 / (AM_DC_SECONDS * demodulator->out_sample_rate);
+    double dc = demodulator->dc;
+    for (int i = 0; i < fe->out_length; i++) {
+        double envelope = sqrt(fe->out_i[i] * fe->out_i[i] + fe->out_q[i] * fe->out_q[i]);
+        dc += alpha * (envelope - dc);
+        demodulator->audio_samples[i] = envelope - dc;
+    }
+    demodulator->dc = dc;
+}
+
+void nrf_am_demodulator_free(nrf_am_demodulator *demodulator) {
+    nrf_front_end_free(demodulator->front_end);
+    free(demodulator->audio_samples);
+    free(demodulator);
+}
+
+// SSB Demodulator
+
+// The audio passband is 0 - 2 * SSB_HALF_BANDWIDTH Hz from the carrier.
+static const int SSB_HALF_BANDWIDTH = 1500;
+
+// Weaver's method: the front end keeps both sidebands, at the audio rate.
+// Mixing down by half the audio bandwidth centers the wanted sideband on
+// 0 Hz, so a low-pass filter removes the other one. Mixing back up and
+// taking the real part gives the audio.
+nrf_ssb_demodulator *nrf_ssb_demodulator_new(int in_sample_rate, int out_sample_rate, nrf_sideband sideband) {
+    nrf_ssb_demodulator *d = calloc(1, sizeof(nrf_ssb_demodulator));
+    d->in_sample_rate = in_sample_rate;
+    d->out_sample_rate = out_sample_rate;
+    d->sideband = sideband;
+    d->front_end = nrf_front_end_new(in_sample_rate, out_sample_rate, SSB_HALF_BANDWIDTH * 2);
+    double transition = SSB_HALF_BANDWIDTH / 4.0;
+    d->filter_i = _nrf_downsampler_new_with_transition(out_sample_rate, out_sample_rate, SSB_HALF_BANDWIDTH, transition);
+    d->filter_q = _nrf_downsampler_new_with_transition(out_sample_rate, out_sample_rate, SSB_HALF_BANDWIDTH, transition);
+    return d;
+}
+
+void nrf_ssb_demodulator_process(nrf_ssb_demodulator *demodulator, double *samples_i, double *samples_q, int length) {
+    nrf_front_end *fe = demodulator->front_end;
+    nrf_front_end_process(fe, samples_i, samples_q, length);
+
+    double shift = demodulator->sideband == NRF_SIDEBAND_UPPER ? -SSB_HALF_BANDWIDTH : SSB_HALF_BANDWIDTH;
+    uint64_t step_down = _nrf_nco_step(shift, demodulator->out_sample_rate);
+    uint64_t step_up = _nrf_nco_step(-shift, demodulator->out_sample_rate);
+    demodulator->phase_down = _nrf_nco_mix(demodulator->phase_down, step_down, fe->out_i, fe->out_q, 1, fe->out_length, 0);
+    nrf_downsampler_process(demodulator->filter_i, fe->out_i, fe->out_length);
+    nrf_downsampler_process(demodulator->filter_q, fe->out_q, fe->out_length);
+
+    int audio_length = demodulator->filter_i->out_length;
+    double *out_i = demodulator->filter_i->out_samples;
+    double *out_q = demodulator->filter_q->out_samples;
+    demodulator->phase_up = _nrf_nco_mix(demodulator->phase_up, step_up, out_i, out_q, 1, audio_length, 0);
+    _nrf_audio_samples_reserve(&demodulator->audio_samples, &demodulator->audio_samples_length, audio_length);
+    for (int i = 0; i < audio_length; i++) {
+        demodulator->audio_samples[i] = out_i[i] * 2;
+    }
+}
+
+void nrf_ssb_demodulator_free(nrf_ssb_demodulator *demodulator) {
+    nrf_front_end_free(demodulator->front_end);
+    nrf_downsampler_free(demodulator->filter_i);
+    nrf_downsampler_free(demodulator->filter_q);
+    free(demodulator->audio_samples);
+    free(demodulator);
+}
+
 // Decoder
 
 nrf_decoder *nrf_decoder_new(nrf_demodulate_type demodulate_type, int in_sample_rate, int out_sample_rate, int freq_offset) {
@@ -1041,27 +3163,41 @@ nrf_decoder *nrf_decoder_new(nrf_demodulate_type demodulate_type, int in_sample_
         decoder->demodulator = nrf_raw_demodulator_new(decoder->in_sample_rate, decoder->out_sample_rate);
     } else if (decoder->demodulate_type == NRF_DEMODULATE_WBFM) {
         decoder->demodulator = nrf_fm_demodulator_new(decoder->in_sample_rate, decoder->out_sample_rate);
+    } else if (decoder->demodulate_type == NRF_DEMODULATE_NBFM) {
+        nrf_fm_config config = {out_sample_rate, NBFM_BANDWIDTH, NBFM_MAX_DEVIATION, NBFM_AUDIO_FREQ, 0};
+        decoder->demodulator = nrf_fm_demodulator_new_with_config(decoder->in_sample_rate, decoder->out_sample_rate, config);
+    } else if (decoder->demodulate_type == NRF_DEMODULATE_AM) {
+        decoder->demodulator = nrf_am_demodulator_new(decoder->in_sample_rate, decoder->out_sample_rate);
+    } else if (decoder->demodulate_type == NRF_DEMODULATE_USB || decoder->demodulate_type == NRF_DEMODULATE_LSB) {
+        nrf_sideband sideband = decoder->demodulate_type == NRF_DEMODULATE_USB ? NRF_SIDEBAND_UPPER : NRF_SIDEBAND_LOWER;
+        decoder->demodulator = nrf_ssb_demodulator_new(decoder->in_sample_rate, decoder->out_sample_rate, sideband);
+    } else {
+        fprintf(stderr, "ERROR nrf_decoder_new: Unknown demodulate type %d.\n", demodulate_type);
+        exit(EXIT_FAILURE);
     }
     decoder->freq_shifter = nrf_freq_shifter_new(freq_offset, in_sample_rate);
+    decoder->converter = nrf_iq_converter_new(0, 0);
     return decoder;
 }
 
-void nrf_decoder_process(nrf_decoder *decoder, uint8_t *buffer, size_t length) {
+void nrf_decoder_process(nrf_decoder *decoder, const uint8_t *buffer, size_t length) {
     // Convert 8-bit samples to doubles
     if (decoder->samples_length != length) {
+        free(decoder->samples);
         free(decoder->samples_i);
         free(decoder->samples_q);
+        decoder->samples = calloc(length * 2, sizeof(float));
         decoder->samples_i = calloc(length, sizeof(double));
         decoder->samples_q = calloc(length, sizeof(double));
+        decoder->samples_length = length;
     }
 
     double *samples_i = decoder->samples_i;
     double *samples_q = decoder->samples_q;
+    nrf_iq_converter_convert(decoder->converter, buffer, length, decoder->samples);
     for (int i = 0; i < length; i++) {
-        double vi = buffer[i * 2]  / 128.0 - 0.995;
-        double vq = buffer[i * 2 + 1]  / 128.0 - 0.995;
-        samples_i[i] = vi;
-        samples_q[i] = vq;
+        samples_i[i] = decoder->samples[i * 2];
+        samples_q[i] = decoder->samples[i * 2 + 1];
     }
 
     // Shift frequency
@@ -1074,59 +3210,162 @@ void nrf_decoder_process(nrf_decoder *decoder, uint8_t *buffer, size_t length) {
         // FIXME: memcpy?
         decoder->audio_samples = demodulator->audio_samples;
         decoder->audio_samples_length = demodulator->audio_samples_length;
-    } else if (decoder->demodulate_type == NRF_DEMODULATE_WBFM) {
+    } else if (decoder->demodulate_type == NRF_DEMODULATE_WBFM || decoder->demodulate_type == NRF_DEMODULATE_NBFM) {
         nrf_fm_demodulator *demodulator = (nrf_fm_demodulator*) decoder->demodulator;
         nrf_fm_demodulator_process(demodulator, samples_i, samples_q, length);
         // FIXME: memcpy?
         decoder->audio_samples = demodulator->audio_samples;
         decoder->audio_samples_length = demodulator->audio_samples_length;
+    } else if (decoder->demodulate_type == NRF_DEMODULATE_AM) {
+        nrf_am_demodulator *demodulator = (nrf_am_demodulator*) decoder->demodulator;
+        nrf_am_demodulator_process(demodulator, samples_i, samples_q, length);
+        decoder->audio_samples = demodulator->audio_samples;
+        decoder->audio_samples_length = demodulator->audio_samples_length;
+    } else {
+        nrf_ssb_demodulator *demodulator = (nrf_ssb_demodulator*) decoder->demodulator;
+        nrf_ssb_demodulator_process(demodulator, samples_i, samples_q, length);
+        decoder->audio_samples = demodulator->audio_samples;
+        decoder->audio_samples_length = demodulator->audio_samples_length;
     }
 }
 
 void nrf_decoder_free(nrf_decoder *decoder) {
     if (decoder->demodulate_type == NRF_DEMODULATE_RAW) {
         nrf_raw_demodulator_free(decoder->demodulator);
-    } else if (decoder->demodulate_type == NRF_DEMODULATE_WBFM) {
+    } else if (decoder->demodulate_type == NRF_DEMODULATE_WBFM || decoder->demodulate_type == NRF_DEMODULATE_NBFM) {
         nrf_fm_demodulator_free(decoder->demodulator);
+    } else if (decoder->demodulate_type == NRF_DEMODULATE_AM) {
+        nrf_am_demodulator_free(decoder->demodulator);
+    } else {
+        nrf_ssb_demodulator_free(decoder->demodulator);
     }
     nrf_freq_shifter_free(decoder->freq_shifter);
+    nrf_iq_converter_free(decoder->converter);
+    free(decoder->samples);
+    free(decoder->samples_i);
+    free(decoder->samples_q);
     free(decoder);
 }
 
-// Buffer queue
+static inline int16_t _nrf_audio_to_s16(double v) {
+    v *= 32000;
+    return v > 32767 ? 32767 : v < -32768 ? -32768 : v;
+}
+
+// Offline decoding
 
-static _nut_buffer_queue *_nut_buffer_queue_new(int capacity) {
-    _nut_buffer_queue *q = calloc(1, sizeof(_nut_buffer_queue));
-    q->size = 0;
-    q->capacity = capacity;
-    q->values = calloc(capacity, sizeof(ALuint));
-    return q;
+static const int DECODE_FILE_DEFAULT_OUT_SAMPLE_RATE = 48000;
+
+static void _nrf_write_u16_le(uint8_t *dst, uint16_t v) {
+    dst[0] = v & 0xff;
+    dst[1] = v >> 8;
 }
 
-static void _nut_buffer_queue_push(_nut_buffer_queue *q, ALuint v) {
-    if (q->size + 1 > q->capacity) {
-        fprintf(stderr, "Queue is too small (capacity: %d)\n", q->capacity);
-    }
-    q->values[q->size] = v;
-    q->size++;
+static void _nrf_write_u32_le(uint8_t *dst, uint32_t v) {
+    _nrf_write_u16_le(dst, v & 0xffff);
+    _nrf_write_u16_le(dst + 2, v >> 16);
+}
+
+// Write a 16-bit mono WAV header for data_size bytes of samples.
+static void _nrf_write_wav_header(FILE *fp, int sample_rate, uint32_t data_size) {
+    uint8_t header[44];
+    memcpy(header, "RIFF", 4);
+    _nrf_write_u32_le(header + 4, 36 + data_size);
+    memcpy(header + 8, "WAVEfmt ", 8);
+    _nrf_write_u32_le(header + 16, 16);
+    _nrf_write_u16_le(header + 20, 1); // PCM
+    _nrf_write_u16_le(header + 22, 1); // Mono
+    _nrf_write_u32_le(header + 24, sample_rate);
+    _nrf_write_u32_le(header + 28, sample_rate * 2);
+    _nrf_write_u16_le(header + 32, 2);
+    _nrf_write_u16_le(header + 34, 16);
+    memcpy(header + 36, "data", 4);
+    _nrf_write_u32_le(header + 40, data_size);
+    fwrite(header, sizeof(header), 1, fp);
 }
 
-static ALuint _nut_buffer_queue_pop(_nut_buffer_queue *q) {
-    if (q->size == 0) {
-        fprintf(stderr, "No more items to pop.\n");
+// Decode an IQ capture (interleaved unsigned 8-bit samples, as read from the
+// device) to 16-bit PCM, as fast as possible. No device or sound card is
+// needed. Returns 0 on success, -1 if a file couldn't be opened or written.
+int nrf_decode_file(const char *in_file, const char *out_file, const nrf_decode_file_config config, nrf_decode_file_stats *stats) {
+    int sample_rate = config.sample_rate > 0 ? config.sample_rate : NRF_DECODE_FILE_DEFAULT_SAMPLE_RATE;
+    int out_sample_rate = config.out_sample_rate > 0 ? config.out_sample_rate : DECODE_FILE_DEFAULT_OUT_SAMPLE_RATE;
+
+    FILE *in_fp = fopen(in_file, "rb");
+    if (!in_fp) {
+        fprintf(stderr, "ERROR nrf_decode_file: Couldn't open %s.\n", in_file);
+        return -1;
     }
-    int v = q->values[0];
-    // Shift all items.
-    for (int i = 1; i < q->size; i++) {
-        q->values[i-1] = q->values[i];
+    FILE *out_fp = fopen(out_file, "wb");
+    if (!out_fp) {
+        fprintf(stderr, "ERROR nrf_decode_file: Couldn't open %s.\n", out_file);
+        fclose(in_fp);
+        return -1;
+    }
+    if (config.format == NRF_AUDIO_FORMAT_WAV) {
+        // The sizes are filled in at the end.
+        _nrf_write_wav_header(out_fp, out_sample_rate, 0);
+    }
+
+    nrf_decoder *decoder = nrf_decoder_new(config.demodulate_type, sample_rate, out_sample_rate, config.freq_offset);
+    uint8_t *in_samples = malloc(NRF_BUFFER_SIZE_BYTES);
+    int out_capacity = 0;
+    int16_t *out_samples = NULL;
+    uint64_t in_count = 0;
+    uint64_t out_count = 0;
+    int status = 0;
+
+    double t_start = nut_time_seconds();
+    size_t bytes_read;
+    while ((bytes_read = fread(in_samples, 1, NRF_BUFFER_SIZE_BYTES, in_fp)) >= 2) {
+        size_t length = bytes_read / 2;
+        nrf_decoder_process(decoder, in_samples, length);
+        in_count += length;
+
+        int audio_length = decoder->audio_samples_length;
+        if (audio_length > out_capacity) {
+            free(out_samples);
+            out_samples = malloc(audio_length * sizeof(int16_t));
+            out_capacity = audio_length;
+        }
+        for (int i = 0; i < audio_length; i++) {
+            out_samples[i] = _nrf_audio_to_s16(decoder->audio_samples[i]);
+        }
+        if (fwrite(out_samples, sizeof(int16_t), audio_length, out_fp) != (size_t) audio_length) {
+            fprintf(stderr, "ERROR nrf_decode_file: Couldn't write to %s.\n", out_file);
+            status = -1;
+            break;
+        }
+        out_count += audio_length;
+    }
+    double seconds = nut_time_seconds() - t_start;
+
+    if (status == 0 && config.format == NRF_AUDIO_FORMAT_WAV) {
+        uint64_t data_size = out_count * sizeof(int16_t);
+        if (data_size > UINT32_MAX - 36) {
+            fprintf(stderr, "WARN nrf_decode_file: %s is too large for a WAV header.\n", out_file);
+            data_size = UINT32_MAX - 36;
+        }
+        if (fseek(out_fp, 0, SEEK_SET) == 0) {
+            _nrf_write_wav_header(out_fp, out_sample_rate, data_size);
+        }
     }
-    q->size--;
-    return v;
-}
 
-static void _nut_buffer_queue_free(_nut_buffer_queue *q) {
-    free(q->values);
-    free(q);
+    nrf_decoder_free(decoder);
+    free(in_samples);
+    free(out_samples);
+    fclose(in_fp);
+    if (fclose(out_fp) != 0) {
+        status = -1;
+    }
+
+    if (stats != NULL) {
+        stats->in_samples = in_count;
+        stats->out_samples = out_count;
+        stats->seconds = seconds;
+        stats->msps = seconds > 0 ? in_count / seconds / 1e6 : 0;
+    }
+    return status;
 }
 
 // Audio Player
@@ -1167,71 +3406,106 @@ static void _nrf_al_check_error(const char *file, int line) {
 
 #define _NRF_AL_CHECK_ERROR() _nrf_al_check_error(__FILE__, __LINE__)
 
-void _nrf_player_decode(nrf_device *device, void *ctx) {
+void _nrf_player_decode(nrf_device *device, const uint8_t *samples, void *ctx) {
     nrf_player *player = (nrf_player *) ctx;
 
-    if (player->shutting_down) return;
-
     // Decode/demodulate the signal.
-    nrf_decoder_process(player->decoder, device->samples, NRF_SAMPLES_LENGTH);
+    nrf_decoder_process(player->decoder, samples, NRF_SAMPLES_LENGTH);
 
-    if (player->shutting_down) return;
-
-    // Convert to signed 16-bit integers.
+    // Convert to signed 16-bit integers, straight into the PCM ring. If the
+    // audio thread fell behind, drop what doesn't fit.
     double *audio_samples = player->decoder->audio_samples;
-    int audio_samples_length = player->decoder->audio_samples_length;
-    int16_t *pcm_samples = calloc(audio_samples_length, sizeof(int16_t));
-    for (int i = 0; i < audio_samples_length; i++) {
-        pcm_samples[i] = audio_samples[i] * 32000;
+    int length = player->decoder->audio_samples_length;
+    uint64_t write = player->pcm_write;
+    uint64_t read = NUT_ATOMIC_LOAD(&player->pcm_read);
+    int space = NRF_PLAYER_RING_SAMPLES - (int) (write - read);
+    if (length > space) {
+        NUT_ATOMIC_ADD(&player->overruns, 1);
+        length = space;
     }
-
-    if (player->shutting_down) return;
-
-    // Check if there are processed buffers we need to unqueue
-    int processed_buffers;
-    alGetSourceiv(player->audio_source, AL_BUFFERS_PROCESSED, &processed_buffers);
-    _NRF_AL_CHECK_ERROR();
-    assert (processed_buffers <= player->audio_buffer_queue->size);
-    while (processed_buffers > 0) {
-        ALuint buffer_id = _nut_buffer_queue_pop(player->audio_buffer_queue);
-        alSourceUnqueueBuffers(player->audio_source, 1, &buffer_id);
-        _NRF_AL_CHECK_ERROR();
-        alDeleteBuffers(1, &buffer_id);
-        processed_buffers--;
+    for (int i = 0; i < length; i++) {
+        player->pcm_ring[(write + i) & (NRF_PLAYER_RING_SAMPLES - 1)] = _nrf_audio_to_s16(audio_samples[i]);
     }
+    NUT_ATOMIC_STORE(&player->pcm_write, write + length);
+}
 
-    // Initialize an audio buffer
-    ALuint buffer_id;
-    alGenBuffers(1, &buffer_id);
-    _NRF_AL_CHECK_ERROR();
-    _nut_buffer_queue_push(player->audio_buffer_queue, buffer_id);
-
-    // Set the data for the buffer
-    alBufferData(buffer_id, AL_BUFFER_FORMAT, pcm_samples, audio_samples_length * sizeof(int16_t), AUDIO_SAMPLE_RATE);
-    _NRF_AL_CHECK_ERROR();
-
-    alSourceQueueBuffers(player->audio_source, 1, &buffer_id);
-    _NRF_AL_CHECK_ERROR();
-
-    ALint source_state;
-    alGetSourcei(player->audio_source, AL_SOURCE_STATE, &source_state);
-    if (source_state != AL_PLAYING && player->audio_buffer_queue->size >= 1) {
-        alSourcePlay(player->audio_source);
+// Moves audio from the PCM ring to OpenAL, keeping about latency_ms of
+// audio queued on the source.
+static void *_nrf_player_audio_loop(nrf_player *player) {
+    int16_t chunk[NRF_PLAYER_CHUNK_SAMPLES];
+    while (NUT_ATOMIC_LOAD(&player->audio_running)) {
+        // Recycle the buffers OpenAL has played.
+        ALint processed;
+        alGetSourcei(player->audio_source, AL_BUFFERS_PROCESSED, &processed);
         _NRF_AL_CHECK_ERROR();
-    }
+        int queued_samples = player->queued_samples;
+        if (processed > 0) {
+            ALuint buffer_ids[NRF_PLAYER_AL_BUFFERS];
+            alSourceUnqueueBuffers(player->audio_source, processed, buffer_ids);
+            _NRF_AL_CHECK_ERROR();
+            for (int i = 0; i < processed; i++) {
+                queued_samples -= player->audio_buffer_lengths[player->queued_head];
+                player->queued_head = (player->queued_head + 1) % NRF_PLAYER_AL_BUFFERS;
+                player->queued_count--;
+            }
+        }
 
-    // The data is now stored in OpenAL, delete our PCM sample buffer.
-    free(pcm_samples);
+        int target = NUT_ATOMIC_LOAD_RELAXED(&player->latency_ms) * AUDIO_SAMPLE_RATE / 1000;
+        uint64_t write = NUT_ATOMIC_LOAD(&player->pcm_write);
+        uint64_t read = player->pcm_read;
+        // If the decoder runs ahead of playback, skip ahead so the latency
+        // doesn't keep growing.
+        if (write - read > (uint64_t) target * 2) {
+            read = write - target;
+            NUT_ATOMIC_ADD(&player->overruns, 1);
+        }
+        while (player->queued_count < NRF_PLAYER_AL_BUFFERS && queued_samples < target && write - read >= NRF_PLAYER_CHUNK_SAMPLES) {
+            for (int i = 0; i < NRF_PLAYER_CHUNK_SAMPLES; i++) {
+                chunk[i] = player->pcm_ring[(read + i) & (NRF_PLAYER_RING_SAMPLES - 1)];
+            }
+            read += NRF_PLAYER_CHUNK_SAMPLES;
+            int index = (player->queued_head + player->queued_count) % NRF_PLAYER_AL_BUFFERS;
+            ALuint buffer_id = player->audio_buffers[index];
+            alBufferData(buffer_id, AL_BUFFER_FORMAT, chunk, sizeof(chunk), AUDIO_SAMPLE_RATE);
+            _NRF_AL_CHECK_ERROR();
+            alSourceQueueBuffers(player->audio_source, 1, &buffer_id);
+            _NRF_AL_CHECK_ERROR();
+            player->audio_buffer_lengths[index] = NRF_PLAYER_CHUNK_SAMPLES;
+            player->queued_count++;
+            queued_samples += NRF_PLAYER_CHUNK_SAMPLES;
+        }
+        NUT_ATOMIC_STORE(&player->pcm_read, read);
+        NUT_ATOMIC_STORE_RELAXED(&player->queued_samples, queued_samples);
+
+        // The source stops when it runs out of buffers. Start it again once
+        // the queue is back at the latency target.
+        ALint source_state;
+        alGetSourcei(player->audio_source, AL_SOURCE_STATE, &source_state);
+        if (source_state != AL_PLAYING) {
+            if (player->playing) {
+                NUT_ATOMIC_ADD(&player->underruns, 1);
+                player->playing = 0;
+            }
+            if (queued_samples >= target) {
+                alSourcePlay(player->audio_source);
+                _NRF_AL_CHECK_ERROR();
+                player->playing = 1;
+            }
+        }
+        nut_sleep_milliseconds(NRF_PLAYER_CHUNK_SAMPLES * 1000 / AUDIO_SAMPLE_RATE / 2);
+    }
+    return NULL;
 }
 
 nrf_player *nrf_player_new(nrf_device *device, nrf_demodulate_type demodulate_type, int freq_offset) {
     nrf_player *player = calloc(1, sizeof(nrf_player));
     player->device = device;
     player->decoder = nrf_decoder_new(demodulate_type, device->sample_rate, AUDIO_SAMPLE_RATE, freq_offset);
+    player->latency_ms = NRF_PLAYER_DEFAULT_LATENCY_MS;
 
      // Initialize the audio context
     player->audio_device = alcOpenDevice(NULL);
-    if (!device) {
+    if (!player->audio_device) {
         fprintf(stderr, "Could not open audio device.\n");
         exit(EXIT_FAILURE);
     }
@@ -1247,8 +3521,13 @@ nrf_player *nrf_player_new(nrf_device *device, nrf_demodulate_type demodulate_ty
     alSourcei(player->audio_source, AL_LOOPING, AL_FALSE);
     _NRF_AL_CHECK_ERROR();
 
-    // Create an audio buffer queue.
-    player->audio_buffer_queue = _nut_buffer_queue_new(1000);
+    // Create the audio buffers once; they are reused while playing.
+    alGenBuffers(NRF_PLAYER_AL_BUFFERS, player->audio_buffers);
+    _NRF_AL_CHECK_ERROR();
+    player->pcm_ring = calloc(NRF_PLAYER_RING_SAMPLES, sizeof(int16_t));
+
+    player->audio_running = 1;
+    pthread_create(&player->audio_thread, NULL, (void *(*)(void *)) _nrf_player_audio_loop, player);
 
     // Register device callback
     nrf_device_set_decode_handler(device, _nrf_player_decode, player);
@@ -1257,7 +3536,7 @@ nrf_player *nrf_player_new(nrf_device *device, nrf_demodulate_type demodulate_ty
 }
 
 void nrf_player_set_freq_offset(nrf_player *player, int freq_offset) {
-    player->decoder->freq_shifter->freq_offset = freq_offset;
+    nrf_freq_shifter_set_freq_offset(player->decoder->freq_shifter, freq_offset);
 }
 
 void nrf_player_set_gain(nrf_player *player, float gain) {
@@ -1265,16 +3544,40 @@ void nrf_player_set_gain(nrf_player *player, float gain) {
     alSourcef(player->audio_source, AL_GAIN, gain);
 }
 
+// Sets how much audio is queued before playback starts. Lower values react
+// faster to tuning, higher values survive slow frames.
+void nrf_player_set_latency(nrf_player *player, int latency_ms) {
+    int min_ms = NRF_PLAYER_CHUNK_SAMPLES * 1000 / AUDIO_SAMPLE_RATE;
+    int max_ms = min_ms * (NRF_PLAYER_AL_BUFFERS - 1);
+    latency_ms = latency_ms < min_ms ? min_ms : latency_ms > max_ms ? max_ms : latency_ms;
+    NUT_ATOMIC_STORE_RELAXED(&player->latency_ms, latency_ms);
+}
+
+nrf_player_stats nrf_player_get_stats(nrf_player *player) {
+    nrf_player_stats stats;
+    stats.underruns = NUT_ATOMIC_LOAD_RELAXED(&player->underruns);
+    stats.overruns = NUT_ATOMIC_LOAD_RELAXED(&player->overruns);
+    uint64_t pending = NUT_ATOMIC_LOAD_RELAXED(&player->pcm_write) - NUT_ATOMIC_LOAD_RELAXED(&player->pcm_read);
+    int queued_samples = NUT_ATOMIC_LOAD_RELAXED(&player->queued_samples);
+    stats.latency_ms = (queued_samples + (double) pending) * 1000.0 / AUDIO_SAMPLE_RATE;
+    return stats;
+}
+
 void nrf_player_free(nrf_player *player) {
-    player->shutting_down = 1;
+    // After this, the decoder no longer runs.
     nrf_device_set_decode_handler(player->device, NULL, NULL);
+    NUT_ATOMIC_STORE(&player->audio_running, 0);
+    pthread_join(player->audio_thread, NULL);
+    alSourceStop(player->audio_source);
+    alSourcei(player->audio_source, AL_BUFFER, 0);
+    alDeleteSources(1, &player->audio_source);
+    alDeleteBuffers(NRF_PLAYER_AL_BUFFERS, player->audio_buffers);
     alcMakeContextCurrent(NULL);
     alcDestroyContext(player->audio_context);
     alcCloseDevice(player->audio_device);
-    player->shutting_down = 1;
 
     // Note we don't own the NRF device, so we're not going to free it.
     nrf_decoder_free(player->decoder);
-    _nut_buffer_queue_free(player->audio_buffer_queue);
+    free(player->pcm_ring);
     free(player);
 }
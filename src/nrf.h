@@ -19,12 +19,15 @@
 #define NRF_BUFFER_SIZE_BYTES (16 * 16384)
 #define NRF_SAMPLES_LENGTH 131072
 #define NRF_IQ_RESOLUTION 256
+#define NRF_RING_SLOTS 8
 #define DEFAULT_FFT_SIZE 128
 #define DEFAULT_FFT_HISTORY_SIZE 128
 
 // Block
 
 #define NRF_BLOCK_MAX_OUTPUTS 10
+#define NRF_BLOCK_MAX_INPUTS 10
+#define NRF_EDGE_DEFAULT_QUEUE_LENGTH 4
 
 typedef enum {
     NRF_BLOCK_SOURCE = 1,
@@ -32,8 +35,37 @@ typedef enum {
     NRF_BLOCK_SINK
 } nrf_block_type;
 
+// What happens to the buffers passed along a connection between blocks.
+// A synchronous edge runs the output block on the thread of the input block.
+// The others queue the buffers for a worker thread of the output block, and
+// differ in what they do when the queue is full.
+typedef enum {
+    NRF_EDGE_SYNC = 0,
+    NRF_EDGE_BLOCK,
+    NRF_EDGE_DROP_NEWEST,
+    NRF_EDGE_DROP_OLDEST
+} nrf_edge_policy;
+
+typedef struct {
+    nrf_edge_policy policy;
+    int queue_length;
+} nrf_edge_config;
+
 typedef struct nrf_block nrf_block;
 
+// A connection between two blocks. The output block owns it. Synchronous
+// edges have no queue.
+typedef struct {
+    nrf_edge_config config;
+    nrf_block *producer;
+    nrf_block *consumer;
+    nut_buffer **queue;
+    int head;
+    int count;
+    uint64_t pushed;
+    uint64_t dropped;
+} nrf_edge;
+
 typedef void (*nrf_block_process_fn)(nrf_block *block, nut_buffer *buffer);
 typedef nut_buffer* (*nrf_block_result_fn)(void *block);
 
@@ -41,22 +73,79 @@ struct nrf_block {
     nrf_block_type type;
     nrf_block_process_fn process_fn;
     nrf_block_result_fn result_fn;
+    // The mutex is held while buffers are passed to the outputs, so an
+    // output block can unlink itself safely.
+    pthread_mutex_t outputs_mutex;
     int n_outputs;
     void* outputs[NRF_BLOCK_MAX_OUTPUTS];
+    nrf_edge *edges[NRF_BLOCK_MAX_OUTPUTS];
+
+    // The inputs are either all synchronous or all queued. Queued inputs
+    // are processed on the worker thread, and the worker mutex protects
+    // their queues.
+    int n_inputs;
+    nrf_edge *inputs[NRF_BLOCK_MAX_INPUTS];
+    int next_input;
+    int worker_running;
+    pthread_t worker_thread;
+    pthread_mutex_t worker_mutex;
+    pthread_cond_t input_cond;
+    pthread_cond_t space_cond;
 };
 
 void nrf_block_init(nrf_block* block, nrf_block_type type, nrf_block_process_fn process_fn, nrf_block_result_fn result_fn);
 void nrf_block_connect(nrf_block* input, nrf_block* output);
+void nrf_block_connect_with_config(nrf_block* input, nrf_block* output, nrf_edge_config config);
 void nrf_block_process(nrf_block* block, nut_buffer* buffer);
+void nrf_block_deinit(nrf_block* block);
 
 #define NRF_BLOCK nrf_block block
 
+// IQ converter, turns raw 8-bit device samples into centered complex floats.
+// It can remove the DC offset and correct the gain and phase imbalance
+// between I and Q, using running estimates over about `averaging` samples.
+
+#define NRF_IQ_CONVERTER_DEFAULT_AVERAGING 1048576
+
+typedef struct {
+    int dc_removal;
+    int iq_balance;
+    int averaging;
+} nrf_iq_converter_config;
+
+typedef struct {
+    NRF_BLOCK;
+    nrf_iq_converter_config config;
+    int has_estimates;
+    double mean_i;
+    double mean_q;
+    double var_i;
+    double var_q;
+    double cov_iq;
+    nut_buffer *buffer;
+} nrf_iq_converter;
+
+nrf_iq_converter *nrf_iq_converter_new(int dc_removal, int iq_balance);
+nrf_iq_converter *nrf_iq_converter_new_with_config(nrf_iq_converter_config config);
+void nrf_iq_converter_convert(nrf_iq_converter *c, const uint8_t *in, int length, float *out);
+void nrf_iq_converter_process(nrf_iq_converter *c, nut_buffer *buffer);
+nut_buffer *nrf_iq_converter_get_buffer(nrf_iq_converter *c);
+void nrf_iq_converter_free(nrf_iq_converter *c);
+
 // Device
 
+// How the dummy device replays its data file.
+typedef enum {
+    NRF_REPLAY_REALTIME = 0,
+    NRF_REPLAY_FREE_RUN
+} nrf_replay_pacing;
+
 typedef struct {
     int sample_rate;
     double freq_mhz;
     const char* data_file;
+    nrf_replay_pacing replay_pacing;
+    double replay_speed;
 } nrf_device_config;
 
 typedef enum {
@@ -67,7 +156,19 @@ typedef enum {
 
 typedef struct nrf_device nrf_device;
 
-typedef void (*nrf_device_decode_cb_fn)(nrf_device *device, void *ctx);
+typedef void (*nrf_device_decode_cb_fn)(nrf_device *device, const uint8_t *samples, void *ctx);
+
+typedef struct {
+    uint64_t seq;
+    uint8_t samples[NRF_BUFFER_SIZE_BYTES];
+} nrf_sample_block;
+
+typedef struct {
+    uint64_t received;
+    uint64_t overruns;
+    uint64_t skipped;
+    uint64_t seq;
+} nrf_device_stats;
 
 struct nrf_device {
     NRF_BLOCK;
@@ -75,19 +176,42 @@ struct nrf_device {
     void *device;
     int sample_rate;
 
+    pthread_mutex_t decode_mutex;
     nrf_device_decode_cb_fn decode_cb_fn;
     void *decode_cb_ctx;
 
     pthread_t receive_thread;
-    pthread_mutex_t data_mutex;
     int receiving;
     int paused;
 
     uint8_t *receive_buffer;
-    int dummy_block_length;
-    int dummy_block_index;
 
-    uint8_t samples[NRF_BUFFER_SIZE_BYTES];
+    // The dummy device maps the data file into memory and replays it one
+    // block at a time, starting at dummy_offset (in bytes).
+    const uint8_t *dummy_data;
+    uint64_t dummy_size;
+    uint64_t dummy_offset;
+    nrf_replay_pacing replay_pacing;
+    double replay_speed;
+    int wait_for_reader;
+
+    // Single-producer/single-consumer ring of sample blocks. The receive
+    // thread overwrites the oldest slot and never waits for the consumer.
+    // Each slot's seq is the number of the block it holds, which the
+    // consumer checks to detect blocks that were overwritten while reading.
+    nrf_sample_block ring[NRF_RING_SLOTS];
+    uint64_t write_seq;
+
+    // The block being received, shared with the connected blocks.
+    nut_buffer_store *receive_store;
+
+    // Consumer state: the next block to read, and the block read last.
+    // Sample buffers handed out to the consumer are views of samples_store.
+    uint64_t read_seq;
+    uint64_t samples_seq;
+    uint64_t overruns;
+    uint64_t skipped;
+    nut_buffer_store *samples_store;
 };
 
 nrf_device *nrf_device_new(double freq_mhz, const char* data_file);
@@ -96,7 +220,11 @@ double nrf_device_set_frequency(nrf_device *device, double freq_mhz);
 void nrf_device_set_decode_handler(nrf_device *device, nrf_device_decode_cb_fn fn, void *ctx);
 void nrf_device_set_paused(nrf_device *device, int paused);
 void nrf_device_step(nrf_device *device);
+void nrf_device_seek(nrf_device *device, uint64_t sample_offset);
+void nrf_device_seek_time(nrf_device *device, double seconds);
 nut_buffer *nrf_device_get_samples_buffer(nrf_device *device);
+nut_buffer *nrf_device_next_samples_buffer(nrf_device *device);
+nrf_device_stats nrf_device_get_stats(nrf_device *device);
 nut_buffer *nrf_device_get_iq_buffer(nrf_device *device);
 nut_buffer *nrf_device_get_iq_lines(nrf_device *device, int size_multiplier, float line_percentage);
 nut_buffer *nrf_device_get_fft_buffer(nrf_device *device);
@@ -119,26 +247,132 @@ void nrf_interpolator_free(nrf_interpolator *interpolator);
 
 // IQ Drawing
 
+// Lines are drawn by up to this many threads, each drawing at least
+// NRF_IQ_LINES_MIN_SEGMENTS segments.
+#define NRF_IQ_LINES_MAX_THREADS 8
+#define NRF_IQ_LINES_MIN_SEGMENTS 8192
+
 nut_buffer *nrf_buffer_add_position_channel(nut_buffer *buffer);
 nut_buffer *nrf_buffer_to_iq_points(nut_buffer *buffer);
 nut_buffer *nrf_buffer_to_iq_lines(nut_buffer *buffer, int size_multiplier, float line_percentage);
+nut_buffer *nrf_buffer_to_iq_lines_antialiased(nut_buffer *buffer, int size_multiplier, float line_percentage);
+
+// IQ density, a histogram of I/Q points that is kept across buffers. Older
+// buffers fade out: each new buffer multiplies the weight of the previous
+// ones by decay.
+
+#define NRF_IQ_DENSITY_DEFAULT_DECAY 0.9
+
+typedef enum {
+    NRF_IQ_DENSITY_SATURATE = 0,
+    NRF_IQ_DENSITY_LOG
+} nrf_iq_density_scale;
+
+typedef struct {
+    // The width and height of the image. The default is NRF_IQ_RESOLUTION.
+    int resolution;
+    double decay;
+    // Saturate scales the density by gain and clips it at 255. Log scales
+    // the logarithm of the density so the densest point is 255.
+    nrf_iq_density_scale scale;
+    double gain;
+} nrf_iq_density_config;
+
+typedef struct {
+    NRF_BLOCK;
+    nrf_iq_density_config config;
+    pthread_mutex_t density_mutex;
+    // Instead of decaying all cells for every buffer, new points are added
+    // with an ever larger weight. The density is density / weight.
+    float *density;
+    double weight;
+    nut_buffer *image;
+} nrf_iq_density;
+
+nrf_iq_density *nrf_iq_density_new(nrf_iq_density_config config);
+void nrf_iq_density_process(nrf_iq_density *density, nut_buffer *buffer);
+void nrf_iq_density_clear(nrf_iq_density *density);
+nut_buffer *nrf_iq_density_get_buffer(nrf_iq_density *density);
+void nrf_iq_density_free(nrf_iq_density *density);
 
 // FFT Analysis
 
+// FFTs of at least this size are planned with multiple threads.
+#define NRF_FFT_THREADS_MIN_SIZE 32768
+
+#define NRF_FFT_DEFAULT_OVERLAP 0.5
+
+typedef enum {
+    NRF_WINDOW_NONE = 0,
+    NRF_WINDOW_HANN,
+    NRF_WINDOW_BLACKMAN_HARRIS,
+    NRF_WINDOW_FLAT_TOP
+} nrf_window_type;
+
+typedef struct {
+    int fft_size;
+    int fft_history_size;
+    // The number of FFTW threads, or 0 to use all cores for large FFTs.
+    int threads;
+    // Where FFTW plans are cached, or NULL for ~/.frequensea-fftw-wisdom.
+    const char *wisdom_file;
+    nrf_window_type window;
+    // Average the power of overlapping segments over the whole block
+    // (Welch's method). The output is in dBFS.
+    int averaging;
+    // The overlap between segments, from 0 to 1. The default is 0.5.
+    double overlap;
+    // The maximum number of segments per block, or 0 for no maximum.
+    int max_segments;
+} nrf_fft_config;
+
+// The FFT front end of nrf_fft, also used by the batch tools. It windows
+// one or more segments of a block and gives the power of each bin, with DC
+// in the middle. The fft_history_size of the config is not used.
+typedef struct {
+    int fft_size;
+    int averaging;
+    double overlap;
+    int n_segments;
+    // The window, with the sign flipped on odd samples to center DC.
+    float *window;
+    float window_gain;
+    // Set if the middle bin is replaced by its neighbours.
+    int patch_dc;
+    fftwf_complex *fft_in;
+    fftwf_complex *fft_out;
+    fftwf_plan fft_plan;
+} nrf_spectrum;
+
+nrf_spectrum *nrf_spectrum_new(nrf_fft_config config);
+void nrf_spectrum_process(nrf_spectrum *spectrum, nut_buffer *buffer, float *out);
+void nrf_spectrum_free(nrf_spectrum *spectrum);
+
 typedef struct {
     NRF_BLOCK;
     int fft_size;
     int fft_history_size;
-    double *buffer;
-    fftw_complex *fft_in;
-    fftw_complex *fft_out;
-    fftw_plan fft_plan;
+    // The history is a ring of fft_history_size lines. history_head is the
+    // newest line. Each line remembers the total shift when it was written,
+    // so shifting is applied when the history is read.
+    float *history;
+    int history_head;
+    int *history_shift;
+    int shift;
+    pthread_mutex_t history_mutex;
+    nrf_spectrum *spectrum;
+    float *line;
+    // The newest line, published to connected blocks without copying.
+    nut_buffer *line_buffer;
 } nrf_fft;
 
 nrf_fft *nrf_fft_new(int fft_size, int fft_history_size);
+nrf_fft *nrf_fft_new_with_config(nrf_fft_config config);
 void nrf_fft_shift(nrf_fft *fft, double d);
 void nrf_fft_process(nrf_fft *fft, nut_buffer *buffer);
+nut_buffer *nrf_fft_get_line(nrf_fft *fft);
 nut_buffer *nrf_fft_get_buffer(nrf_fft *fft);
+nut_buffer *nrf_fft_get_ring_buffer(nrf_fft *fft, int *head);
 void nrf_fft_free(nrf_fft *fft);
 
 // Finite Impulse Response (FIR) Filter
@@ -158,15 +392,103 @@ void nrf_fir_filter_load(nrf_fir_filter *filter, double *samples, int length);
 double nrf_fir_filter_get(nrf_fir_filter *filter, int index);
 void nrf_fir_filter_free(nrf_fir_filter *filter);
 
+// SIMD dot products, using AVX2 or SSE if the CPU supports it.
+// nrf_fir_dot_cf32 filters interleaved I/Q samples. Its coefficients are
+// doubled, so each tap appears twice in a row.
+const char *nrf_fir_kernel();
+float nrf_fir_dot_f32(const float *coefficients, const float *samples, int length);
+void nrf_fir_dot_cf32(const float *coefficients, const float *samples, int length, float *out);
+
+// FFT Filter, an overlap-save FFT convolution that can also shift and
+// decimate in the frequency domain
+
+#define NRF_FFT_FILTER_MIN_TAPS 64
+
+typedef struct {
+    int sample_rate;
+    int half_ampl_freq;
+    int kernel_length;
+    // Moves this frequency to 0 Hz before filtering. It is rounded to the
+    // FFT's bin spacing.
+    int freq_offset;
+    // Keeps one out of every n samples. The half-amplitude frequency should
+    // be below sample_rate / decimation / 2.
+    int decimation;
+    // The FFT size, or 0 to pick one from the kernel length.
+    int fft_size;
+} nrf_fft_filter_config;
+
+typedef struct {
+    NRF_BLOCK;
+    int fft_size;
+    int decimation;
+    int overlap;
+    int shift_bins;
+    int time;
+    int fill;
+    fftwf_complex *response;
+    fftwf_complex *fft_in;
+    fftwf_complex *fft_out;
+    fftwf_complex *ifft_in;
+    fftwf_complex *ifft_out;
+    fftwf_plan forward_plan;
+    fftwf_plan inverse_plan;
+    int out_length;
+    nut_buffer *buffer;
+} nrf_fft_filter;
+
+nrf_fft_filter *nrf_fft_filter_new_with_config(nrf_fft_filter_config config);
+void nrf_fft_filter_process(nrf_fft_filter *f, nut_buffer *buffer);
+nut_buffer *nrf_fft_filter_get_buffer(nrf_fft_filter *f);
+void nrf_fft_filter_free(nrf_fft_filter *f);
+
+// Channelizer, a polyphase filter bank that splits the input into
+// n_channels channels, each n_channels times narrower. Each channel has an
+// output block that can be connected to other blocks.
+
+#define NRF_CHANNELIZER_DEFAULT_TAPS 8
+#define NRF_CHANNELIZER_BATCH 64
+
+typedef struct {
+    NRF_BLOCK;
+    int channel;
+    nut_buffer *buffer;
+} nrf_channelizer_output;
+
+typedef struct {
+    NRF_BLOCK;
+    int n_channels;
+    int taps;
+    float *coefficients;
+    int samples_length;
+    float *samples;
+    int next_output;
+    fftwf_complex *fft_in;
+    fftwf_complex *fft_out;
+    fftwf_plan fft_plan;
+    int out_length;
+    nut_buffer *buffer;
+    nrf_channelizer_output *outputs;
+} nrf_channelizer;
+
+nrf_channelizer *nrf_channelizer_new(int n_channels, int taps_per_channel);
+void nrf_channelizer_process(nrf_channelizer *c, nut_buffer *buffer);
+nut_buffer *nrf_channelizer_get_buffer(nrf_channelizer *c);
+nut_buffer *nrf_channelizer_get_channel_buffer(nrf_channelizer *c, int channel);
+nrf_block *nrf_channelizer_get_output(nrf_channelizer *c, int channel);
+void nrf_channelizer_free(nrf_channelizer *c);
+
 // IQ Filter, based on FIR filter
 
 typedef struct {
     NRF_BLOCK;
-    nrf_fir_filter *filter_i;
-    nrf_fir_filter *filter_q;
+    // Set for kernels of NRF_FFT_FILTER_MIN_TAPS or more.
+    nrf_fft_filter *fft_filter;
+    int taps;
+    float *coefficients;
     int samples_length;
-    double *samples_i;
-    double *samples_q;
+    float *samples;
+    nut_buffer *buffer;
 } nrf_iq_filter;
 
 nrf_iq_filter *nrf_iq_filter_new(int sample_rate, int half_ampl_freq, int kernel_length);
@@ -176,11 +498,21 @@ void nrf_iq_filter_free(nrf_iq_filter *filter);
 
 // Downsampler
 
+#define NRF_DOWNSAMPLER_MAX_PHASES 256
+#define NRF_DOWNSAMPLER_TAP_ALIGN 8
+
 typedef struct {
     int in_rate;
     int out_rate;
-    nrf_fir_filter *filter;
-    double rate_mul;
+    int interpolation;
+    int decimation;
+    int phases;
+    int taps;
+    float *coefficients;
+    float *samples;
+    int samples_capacity;
+    int next_output;
+    int out_capacity;
     int out_length;
     double *out_samples;
 } nrf_downsampler;
@@ -189,34 +521,117 @@ nrf_downsampler *nrf_downsampler_new(int in_rate, int out_rate, int filter_freq,
 void nrf_downsampler_process(nrf_downsampler *d, double *samples, int length);
 void nrf_downsampler_free(nrf_downsampler *d);
 
+// Demodulator front end
+
+#define NRF_FRONT_END_MAX_TAPS 255
+#define NRF_FRONT_END_MAX_STAGES 3
+
+// Filters and decimates I/Q to the rate a demodulator works at. Large
+// ratios are split into cheap coarse stages and one sharp final stage.
+typedef struct {
+    int in_rate;
+    int out_rate;
+    int bandwidth;
+    int n_stages;
+    nrf_downsampler *stages_i[NRF_FRONT_END_MAX_STAGES];
+    nrf_downsampler *stages_q[NRF_FRONT_END_MAX_STAGES];
+    double *out_i;
+    double *out_q;
+    int out_length;
+} nrf_front_end;
+
+nrf_front_end *nrf_front_end_new(int in_rate, int out_rate, int bandwidth);
+void nrf_front_end_process(nrf_front_end *fe, double *samples_i, double *samples_q, int length);
+void nrf_front_end_free(nrf_front_end *fe);
+
 // Frequency shifter
 
+#define NRF_NCO_LANES 4
+#define NRF_NCO_CHUNK 1024
+
 typedef struct {
     NRF_BLOCK;
     int freq_offset;
     int sample_rate;
-    double cosine;
-    double sine;
+    uint64_t phase;
     nut_buffer *buffer;
 } nrf_freq_shifter;
 
 nrf_freq_shifter *nrf_freq_shifter_new(int freq_offset, int sample_rate);
+void nrf_freq_shifter_set_freq_offset(nrf_freq_shifter *shifter, int freq_offset);
 void nrf_freq_shifter_process_samples(nrf_freq_shifter *shifter, double *samples_i, double *samples_q, int length);
 void nrf_freq_shifter_process(nrf_freq_shifter *shifter, nut_buffer *buffer);
 nut_buffer *nrf_freq_shifter_get_buffer(nrf_freq_shifter *shifter);
 void nrf_freq_shifter_free(nrf_freq_shifter *shifter);
 
-// Signal detector
+// Signal detector, statistics over all values of a buffer, computed in one
+// pass. It can be connected to a device or another block.
+
+#define NRF_SIGNAL_DETECTOR_CHUNK 1024
 
 typedef struct {
+    int64_t count;
     double mean;
+    double variance;
     double standard_deviation;
+    double peak;
+    double rms;
+    double crest_factor;
+} nrf_signal_stats;
+
+typedef struct {
+    NRF_BLOCK;
+    pthread_mutex_t stats_mutex;
+    nrf_signal_stats stats;
 } nrf_signal_detector;
 
 nrf_signal_detector *nrf_signal_detector_new();
 void nrf_signal_detector_process(nrf_signal_detector *detector, nut_buffer *buffer);
+nrf_signal_stats nrf_signal_detector_get_stats(nrf_signal_detector *detector);
 void nrf_signal_detector_free(nrf_signal_detector *detector);
 
+// Carrier detector, a cell-averaging CFAR detector over a spectrum line. A
+// bin is a carrier if it is the highest bin within guard_cells, and its
+// power is threshold_db above the average of the training_cells bins on
+// either side of the guard cells.
+
+#define NRF_CARRIER_DETECTOR_MAX_CARRIERS 64
+#define NRF_CARRIER_DETECTOR_DEFAULT_GUARD_CELLS 2
+#define NRF_CARRIER_DETECTOR_DEFAULT_TRAINING_CELLS 16
+#define NRF_CARRIER_DETECTOR_DEFAULT_THRESHOLD_DB 10
+
+typedef struct {
+    int fft_size;
+    int guard_cells;
+    int training_cells;
+    double threshold_db;
+    // Set if the spectrum is in dB, as with nrf_fft averaging. Otherwise
+    // it holds magnitudes.
+    int input_db;
+} nrf_carrier_detector_config;
+
+typedef struct {
+    int bin;
+    float power_db;
+    float snr_db;
+} nrf_carrier;
+
+typedef struct {
+    NRF_BLOCK;
+    nrf_carrier_detector_config config;
+    double *power;
+    double *sums;
+    pthread_mutex_t carriers_mutex;
+    nrf_carrier carriers[NRF_CARRIER_DETECTOR_MAX_CARRIERS];
+    int n_carriers;
+} nrf_carrier_detector;
+
+nrf_carrier_detector *nrf_carrier_detector_new(nrf_carrier_detector_config config);
+void nrf_carrier_detector_process_line(nrf_carrier_detector *detector, const float *line);
+void nrf_carrier_detector_process(nrf_carrier_detector *detector, nut_buffer *buffer);
+int nrf_carrier_detector_get_carriers(nrf_carrier_detector *detector, nrf_carrier *carriers, int max_carriers);
+void nrf_carrier_detector_free(nrf_carrier_detector *detector);
+
 // RAW Demodulator
 
 typedef struct {
@@ -231,17 +646,32 @@ nrf_raw_demodulator *nrf_raw_demodulator_new(int in_sample_rate, int out_sample_
 void nrf_raw_demodulator_process(nrf_raw_demodulator *demodulator, double *samples_i, double *samples_q, int length);
 void nrf_raw_demodulator_free(nrf_raw_demodulator *demodulator);
 
+// FM discriminator
+
+void nrf_fm_discriminate(const double *samples_i, const double *samples_q, int stride, int length, double *last, double gain, double *out);
+
 // FM Demodulator
 
+typedef struct {
+    // The rate the discriminator runs at.
+    int inter_rate;
+    // The half-amplitude frequency of the channel filter.
+    int bandwidth;
+    int max_deviation;
+    int audio_freq;
+    // The de-emphasis time constant, or 0 for none.
+    double deemphasis_us;
+} nrf_fm_config;
+
 typedef struct {
     int in_sample_rate;
     int out_sample_rate;
     double ampl_conv;
     double l_i;
     double l_q;
+    double deemphasis_alpha;
     double deemphasis_val;
-    nrf_downsampler *downsampler_i;
-    nrf_downsampler *downsampler_q;
+    nrf_front_end *front_end;
     nrf_downsampler *downsampler_audio;
     double *demodulated_samples;
     int demodulated_length;
@@ -250,14 +680,58 @@ typedef struct {
 } nrf_fm_demodulator;
 
 nrf_fm_demodulator *nrf_fm_demodulator_new(int in_sample_rate, int out_sample_rate);
+nrf_fm_demodulator *nrf_fm_demodulator_new_with_config(int in_sample_rate, int out_sample_rate, const nrf_fm_config config);
 void nrf_fm_demodulator_process(nrf_fm_demodulator *demodulator, double *samples_i, double *samples_q, int length);
 void nrf_fm_demodulator_free(nrf_fm_demodulator *demodulator);
 
+// AM Demodulator
+
+typedef struct {
+    int in_sample_rate;
+    int out_sample_rate;
+    double dc;
+    nrf_front_end *front_end;
+    double *audio_samples;
+    int audio_samples_length;
+} nrf_am_demodulator;
+
+nrf_am_demodulator *nrf_am_demodulator_new(int in_sample_rate, int out_sample_rate);
+void nrf_am_demodulator_process(nrf_am_demodulator *demodulator, double *samples_i, double *samples_q, int length);
+void nrf_am_demodulator_free(nrf_am_demodulator *demodulator);
+
+// SSB Demodulator
+
+typedef enum {
+    NRF_SIDEBAND_UPPER = 0,
+    NRF_SIDEBAND_LOWER
+} nrf_sideband;
+
+typedef struct {
+    int in_sample_rate;
+    int out_sample_rate;
+    nrf_sideband sideband;
+    uint64_t phase_down;
+    uint64_t phase_up;
+    nrf_front_end *front_end;
+    nrf_downsampler *filter_i;
+    nrf_downsampler *filter_q;
+    double *audio_samples;
+    int audio_samples_length;
+} nrf_ssb_demodulator;
+
+nrf_ssb_demodulator *nrf_ssb_demodulator_new(int in_sample_rate, int out_sample_rate, nrf_sideband sideband);
+void nrf_ssb_demodulator_process(nrf_ssb_demodulator *demodulator, double *samples_i, double *samples_q, int length);
+void nrf_ssb_demodulator_free(nrf_ssb_demodulator *demodulator);
+
 // Decoder
 
 typedef enum {
     NRF_DEMODULATE_RAW = 0,
-    NRF_DEMODULATE_WBFM
+    NRF_DEMODULATE_WBFM,
+    NRF_DEMODULATE_NBFM,
+    NRF_DEMODULATE_AM,
+    NRF_DEMODULATE_USB,
+    NRF_DEMODULATE_LSB
 } nrf_demodulate_type;
 
 typedef struct {
@@ -266,6 +740,8 @@ typedef struct {
     nrf_demodulate_type demodulate_type;
     void *demodulator;
     nrf_freq_shifter *freq_shifter;
+    nrf_iq_converter *converter;
+    float *samples;
     double *samples_i;
     double *samples_q;
     int samples_length;
@@ -274,15 +750,49 @@ typedef struct {
 } nrf_decoder;
 
 nrf_decoder *nrf_decoder_new(nrf_demodulate_type demodulate_type, int in_sample_rate, int out_sample_rate, int freq_offset);
-void nrf_decoder_process(nrf_decoder *decoder, uint8_t *buffer, size_t length);
+void nrf_decoder_process(nrf_decoder *decoder, const uint8_t *buffer, size_t length);
+void nrf_decoder_free(nrf_decoder *decoder);
+
+// Offline decoding
+
+#define NRF_DECODE_FILE_DEFAULT_SAMPLE_RATE 5000000
+
+typedef enum {
+    NRF_AUDIO_FORMAT_WAV = 0,
+    NRF_AUDIO_FORMAT_RAW
+} nrf_audio_format;
+
+typedef struct {
+    nrf_demodulate_type demodulate_type;
+    int sample_rate;
+    int out_sample_rate;
+    int freq_offset;
+    nrf_audio_format format;
+} nrf_decode_file_config;
+
+typedef struct {
+    uint64_t in_samples;
+    uint64_t out_samples;
+    double seconds;
+    // Throughput, in millions of IQ samples per second.
+    double msps;
+} nrf_decode_file_stats;
+
+int nrf_decode_file(const char *in_file, const char *out_file, const nrf_decode_file_config config, nrf_decode_file_stats *stats);
 
 // Player
 
+#define NRF_PLAYER_AL_BUFFERS 32
+#define NRF_PLAYER_CHUNK_SAMPLES 480
+#define NRF_PLAYER_RING_SAMPLES (1 << 17)
+#define NRF_PLAYER_DEFAULT_LATENCY_MS 100
+
 typedef struct {
-    int size;
-    int capacity;
-    ALuint *values;
-} _nut_buffer_queue;
+    uint64_t underruns;
+    uint64_t overruns;
+    // The audio waiting to be played, in milliseconds.
+    double latency_ms;
+} nrf_player_stats;
 
 typedef struct {
     nrf_demodulate_type demodulate_type;
@@ -291,13 +801,34 @@ typedef struct {
     ALCcontext *audio_context;
     ALCdevice *audio_device;
     ALuint audio_source;
-    _nut_buffer_queue *audio_buffer_queue;
-    int shutting_down;
+
+    // A fixed pool of AL buffers, used as a ring. The queued_count buffers
+    // starting at queued_head are queued on the source.
+    ALuint audio_buffers[NRF_PLAYER_AL_BUFFERS];
+    int audio_buffer_lengths[NRF_PLAYER_AL_BUFFERS];
+    int queued_head;
+    int queued_count;
+    int queued_samples;
+
+    // PCM samples from the decoder to the audio thread. Only the decoder
+    // moves pcm_write, and only the audio thread moves pcm_read.
+    int16_t *pcm_ring;
+    uint64_t pcm_write;
+    uint64_t pcm_read;
+
+    int latency_ms;
+    uint64_t underruns;
+    uint64_t overruns;
+    int playing;
+    int audio_running;
+    pthread_t audio_thread;
 } nrf_player;
 
 nrf_player *nrf_player_new(nrf_device *device, nrf_demodulate_type demodulate_type, int freq_offset);
 void nrf_player_set_freq_offset(nrf_player *player, int freq_offset);
 void nrf_player_set_gain(nrf_player *player, float gain);
+void nrf_player_set_latency(nrf_player *player, int latency_ms);
+nrf_player_stats nrf_player_get_stats(nrf_player *player);
 void nrf_player_free(nrf_player *player);
 
 #endif // NRF_H
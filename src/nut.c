@@ -6,6 +6,7 @@
 
 #include <assert.h>
 #include <math.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -22,50 +23,227 @@ void nut_sleep_milliseconds(int millis) {
     nanosleep(&ts, NULL);
 }
 
-nut_buffer *nut_buffer_new_u8(int length, int channels, const uint8_t *data) {
-    nut_buffer *buffer = calloc(1, sizeof(nut_buffer));
-    buffer->type = NUT_BUFFER_U8;
+void nut_sleep_seconds(double seconds) {
+    if (seconds <= 0) return;
+    struct timespec ts;
+    ts.tv_sec = (time_t) seconds;
+    ts.tv_nsec = (long) ((seconds - ts.tv_sec) * 1e9);
+    nanosleep(&ts, NULL);
+}
+
+// Time
+
+// Return the time in seconds from a clock that never jumps.
+// Only the difference between two calls is meaningful.
+double nut_time_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Buffer pool
+
+// Size classes go from 16 bytes up to 1 GB. Larger blocks bypass the pool.
+#define NUT_POOL_MIN_SHIFT 4
+#define NUT_POOL_CLASSES 27
+
+typedef struct nut_pool_block {
+    struct nut_pool_block *next;
+} nut_pool_block;
+
+// Buffers are released on the receive thread as well as the main thread.
+static pthread_mutex_t nut_pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static nut_pool_block *nut_pool_free_lists[NUT_POOL_CLASSES];
+static nut_buffer_pool_stats nut_pool_stats;
+
+static int _nut_pool_class(size_t size) {
+    int c = 0;
+    while (c < NUT_POOL_CLASSES && ((size_t) 1 << (c + NUT_POOL_MIN_SHIFT)) < size) {
+        c++;
+    }
+    return c;
+}
+
+// Return zeroed memory of at least the given size.
+static void *_nut_pool_alloc(size_t size) {
+    int c = _nut_pool_class(size);
+    if (c == NUT_POOL_CLASSES) {
+        pthread_mutex_lock(&nut_pool_mutex);
+        nut_pool_stats.misses++;
+        nut_pool_stats.bytes_live += size;
+        pthread_mutex_unlock(&nut_pool_mutex);
+        return calloc(size, 1);
+    }
+    size_t class_size = (size_t) 1 << (c + NUT_POOL_MIN_SHIFT);
+    pthread_mutex_lock(&nut_pool_mutex);
+    nut_pool_block *block = nut_pool_free_lists[c];
+    if (block != NULL) {
+        nut_pool_free_lists[c] = block->next;
+        nut_pool_stats.hits++;
+        nut_pool_stats.bytes_pooled -= class_size;
+    } else {
+        nut_pool_stats.misses++;
+    }
+    nut_pool_stats.bytes_live += class_size;
+    pthread_mutex_unlock(&nut_pool_mutex);
+    if (block != NULL) {
+        memset(block, 0, size);
+        return block;
+    } else {
+        return calloc(class_size, 1);
+    }
+}
+
+// Return memory to the pool. The size must be the size it was allocated with.
+static void _nut_pool_free(void *ptr, size_t size) {
+    int c = _nut_pool_class(size);
+    if (c == NUT_POOL_CLASSES) {
+        pthread_mutex_lock(&nut_pool_mutex);
+        nut_pool_stats.bytes_live -= size;
+        pthread_mutex_unlock(&nut_pool_mutex);
+        free(ptr);
+        return;
+    }
+    size_t class_size = (size_t) 1 << (c + NUT_POOL_MIN_SHIFT);
+    nut_pool_block *block = ptr;
+    pthread_mutex_lock(&nut_pool_mutex);
+    block->next = nut_pool_free_lists[c];
+    nut_pool_free_lists[c] = block;
+    nut_pool_stats.bytes_live -= class_size;
+    nut_pool_stats.bytes_pooled += class_size;
+    pthread_mutex_unlock(&nut_pool_mutex);
+}
+
+nut_buffer_pool_stats nut_buffer_get_pool_stats() {
+    pthread_mutex_lock(&nut_pool_mutex);
+    nut_buffer_pool_stats stats = nut_pool_stats;
+    pthread_mutex_unlock(&nut_pool_mutex);
+    return stats;
+}
+
+// Free all memory that is in the pool but not in use.
+void nut_buffer_pool_trim() {
+    pthread_mutex_lock(&nut_pool_mutex);
+    for (int c = 0; c < NUT_POOL_CLASSES; c++) {
+        nut_pool_block *block = nut_pool_free_lists[c];
+        while (block != NULL) {
+            nut_pool_block *next = block->next;
+            free(block);
+            block = next;
+        }
+        nut_pool_free_lists[c] = NULL;
+    }
+    nut_pool_stats.bytes_pooled = 0;
+    pthread_mutex_unlock(&nut_pool_mutex);
+}
+
+// Buffer store
+
+nut_buffer_store *nut_buffer_store_new(int size_bytes) {
+    nut_buffer_store *store = _nut_pool_alloc(sizeof(nut_buffer_store));
+    store->refcount = 1;
+    store->size_bytes = size_bytes;
+    store->data = _nut_pool_alloc(size_bytes);
+    return store;
+}
+
+void nut_buffer_store_retain(nut_buffer_store *store) {
+    NUT_ATOMIC_ADD(&store->refcount, 1);
+}
+
+void nut_buffer_store_release(nut_buffer_store *store) {
+    if (NUT_ATOMIC_ADD(&store->refcount, -1) == 0) {
+        _nut_pool_free(store->data, store->size_bytes);
+        _nut_pool_free(store, sizeof(nut_buffer_store));
+    }
+}
+
+// Buffer
+
+static int _nut_buffer_type_size(nut_buffer_type type) {
+    if (type == NUT_BUFFER_U8) {
+        return sizeof(uint8_t);
+    } else if (type == NUT_BUFFER_S16) {
+        return sizeof(int16_t);
+    } else if (type == NUT_BUFFER_F32 || type == NUT_BUFFER_CF32) {
+        return sizeof(float);
+    } else {
+        return sizeof(double);
+    }
+}
+
+// Create a buffer that points into the store. This takes over a reference
+// to the store from the caller.
+static nut_buffer *_nut_buffer_new_in_store(nut_buffer_type type, int length, int channels, nut_buffer_store *store, uint8_t *data) {
+    nut_buffer *buffer = _nut_pool_alloc(sizeof(nut_buffer));
+    buffer->type = type;
     buffer->length = length;
     buffer->channels = channels;
-    buffer->size_bytes = length * channels * sizeof(uint8_t);
-    buffer->data.u8 = calloc(buffer->size_bytes, 1);
+    buffer->size_bytes = length * channels * _nut_buffer_type_size(type);
+    buffer->data.u8 = data;
+    buffer->store = store;
+    assert(data + buffer->size_bytes <= store->data + store->size_bytes);
+    return buffer;
+}
+
+nut_buffer *nut_buffer_new(nut_buffer_type type, int length, int channels, const void *data) {
+    assert(type != NUT_BUFFER_CF32 || channels % 2 == 0);
+    nut_buffer_store *store = nut_buffer_store_new(length * channels * _nut_buffer_type_size(type));
+    nut_buffer *buffer = _nut_buffer_new_in_store(type, length, channels, store, store->data);
     if (data != NULL) {
         memcpy(buffer->data.u8, data, buffer->size_bytes);
     }
     return buffer;
 }
 
+nut_buffer *nut_buffer_new_u8(int length, int channels, const uint8_t *data) {
+    return nut_buffer_new(NUT_BUFFER_U8, length, channels, data);
+}
+
+nut_buffer *nut_buffer_new_s16(int length, int channels, const int16_t *data) {
+    return nut_buffer_new(NUT_BUFFER_S16, length, channels, data);
+}
+
+nut_buffer *nut_buffer_new_f32(int length, int channels, const float *data) {
+    return nut_buffer_new(NUT_BUFFER_F32, length, channels, data);
+}
+
+// A complex buffer always has an even number of channels: I and Q.
+nut_buffer *nut_buffer_new_cf32(int length, int channels, const float *data) {
+    return nut_buffer_new(NUT_BUFFER_CF32, length, channels, data);
+}
+
 nut_buffer *nut_buffer_new_f64(int length, int channels, const double *data) {
-    nut_buffer *buffer = calloc(1, sizeof(nut_buffer));
-    buffer->type = NUT_BUFFER_F64;
-    buffer->length = length;
-    buffer->channels = channels;
-    buffer->size_bytes = length * channels * sizeof(double);
-    buffer->data.f64 = calloc(buffer->size_bytes, 1);
-    if (data != NULL) {
-        memcpy(buffer->data.f64, data, buffer->size_bytes);
-    }
-    return buffer;
+    return nut_buffer_new(NUT_BUFFER_F64, length, channels, data);
+}
+
+// Create a buffer that shares the contents of the store.
+nut_buffer *nut_buffer_new_with_store(nut_buffer_type type, int length, int channels, nut_buffer_store *store) {
+    nut_buffer_store_retain(store);
+    return _nut_buffer_new_in_store(type, length, channels, store, store->data);
+}
+
+// Create a buffer that shares a range of the given buffer's contents, without
+// copying. The offset and length are in samples, not channels.
+nut_buffer *nut_buffer_new_view(nut_buffer *buffer, int offset, int length) {
+    assert(buffer != NULL);
+    assert(offset >= 0 && offset + length <= buffer->length);
+    int offset_bytes = offset * buffer->channels * _nut_buffer_type_size(buffer->type);
+    nut_buffer_store_retain(buffer->store);
+    return _nut_buffer_new_in_store(buffer->type, length, buffer->channels, buffer->store, buffer->data.u8 + offset_bytes);
 }
 
+// Copying is cheap: the copy shares the data until one of them is modified.
 nut_buffer *nut_buffer_copy(nut_buffer *buffer) {
     assert(buffer != NULL);
-    if (buffer->type == NUT_BUFFER_U8) {
-        return nut_buffer_new_u8(buffer->length, buffer->channels, buffer->data.u8);
-    } else {
-        return nut_buffer_new_f64(buffer->length, buffer->channels, buffer->data.f64);
-    }
+    return nut_buffer_new_view(buffer, 0, buffer->length);
 }
 
 nut_buffer *nut_buffer_reduce(nut_buffer *buffer, double percentage) {
+    assert(buffer != NULL);
     percentage = percentage < 0.0 ? 0.0 : percentage > 1.0 ? 1.0 : percentage;
     int new_length = round(buffer->length * percentage);
-    assert(buffer != NULL);
-    if (buffer->type == NUT_BUFFER_U8) {
-        return nut_buffer_new_u8(new_length, buffer->channels, buffer->data.u8);
-    } else {
-        return nut_buffer_new_f64(new_length, buffer->channels, buffer->data.f64);
-    }
+    return nut_buffer_new_view(buffer, 0, new_length);
 }
 
 nut_buffer *nut_buffer_clip(nut_buffer *buffer, int offset, int length) {
@@ -74,11 +252,25 @@ nut_buffer *nut_buffer_clip(nut_buffer *buffer, int offset, int length) {
     int new_length = length;
     if (new_length < 0 || new_length > buffer->length - offset)
       new_length = buffer->length - offset;
-    if (buffer->type == NUT_BUFFER_U8) {
-        return nut_buffer_new_u8(new_length, buffer->channels, buffer->data.u8 + offset);
-    } else {
-        return nut_buffer_new_f64(new_length, buffer->channels, buffer->data.f64 + offset);
-    }
+    return nut_buffer_new_view(buffer, offset, new_length);
+}
+
+// Return 1 if no other buffer shares the data, so it can be modified in place.
+int nut_buffer_is_writable(nut_buffer *buffer) {
+    return NUT_ATOMIC_LOAD(&buffer->store->refcount) == 1;
+}
+
+// Make sure the buffer has its own copy of the data before modifying it.
+// Buffer functions that modify the data call this; code that writes to the
+// data directly should call it first.
+void nut_buffer_make_writable(nut_buffer *buffer) {
+    nut_buffer_store *store = buffer->store;
+    if (nut_buffer_is_writable(buffer)) return;
+    nut_buffer_store *new_store = nut_buffer_store_new(buffer->size_bytes);
+    memcpy(new_store->data, buffer->data.u8, buffer->size_bytes);
+    buffer->store = new_store;
+    buffer->data.u8 = new_store->data;
+    nut_buffer_store_release(store);
 }
 
 void nut_buffer_set_data(nut_buffer *dst, nut_buffer *src) {
@@ -86,49 +278,50 @@ void nut_buffer_set_data(nut_buffer *dst, nut_buffer *src) {
     assert(src != NULL);
     assert(dst->type == src->type);
     assert(dst->size_bytes == src->size_bytes);
-    if (dst->type == NUT_BUFFER_U8) {
-        memcpy(dst->data.u8, src->data.u8, dst->size_bytes);
-    } else {
-        memcpy(dst->data.f64, src->data.f64, dst->size_bytes);
-    }
+    nut_buffer_make_writable(dst);
+    memcpy(dst->data.u8, src->data.u8, dst->size_bytes);
 }
 
 void nut_buffer_append(nut_buffer *dst, nut_buffer *src) {
     assert(dst != NULL);
     assert(src != NULL);
     assert(dst->type == src->type);
-    int dst_size = dst->length * dst->channels;
-    int src_size = src->length * src->channels;
-    int new_size = dst_size + src_size;
-    if (dst->type == NUT_BUFFER_U8) {
-        uint8_t *new_data = calloc(new_size, sizeof(uint8_t));
-        memcpy(new_data, dst->data.u8, dst->size_bytes);
-        memcpy(new_data + dst_size, src->data.u8, src->size_bytes);
-        free(dst->data.u8);
-        dst->data.u8 = new_data;
-        dst->size_bytes = new_size * sizeof(uint8_t);
-    } else {
-        double *new_data = calloc(new_size, sizeof(double));
-        memcpy(new_data, dst->data.f64, dst->size_bytes);
-        memcpy(new_data + dst_size, src->data.f64, src->size_bytes);
-        free(dst->data.f64);
-        dst->data.f64 = new_data;
-        dst->size_bytes = new_size * sizeof(double);
-    }
+    assert(dst->channels == src->channels);
+    nut_buffer_store *store = nut_buffer_store_new(dst->size_bytes + src->size_bytes);
+    memcpy(store->data, dst->data.u8, dst->size_bytes);
+    memcpy(store->data + dst->size_bytes, src->data.u8, src->size_bytes);
+    nut_buffer_store_release(dst->store);
+    dst->store = store;
+    dst->data.u8 = store->data;
+    dst->size_bytes = store->size_bytes;
     dst->length = dst->length + src->length;
 }
 
+// Values are scaled so that U8 and S16 map to the same range as the floating
+// point types: U8 divides by 256, S16 by 32768.
+#define NUT_U8_SCALE 256.0
+#define NUT_S16_SCALE 32768.0
+
+static int16_t _nut_to_s16(double v) {
+    v = v * NUT_S16_SCALE;
+    return v < INT16_MIN ? INT16_MIN : v > INT16_MAX ? INT16_MAX : (int16_t) v;
+}
+
 uint8_t nut_buffer_get_u8(nut_buffer *buffer, int offset) {
     if (buffer->type == NUT_BUFFER_U8) {
         return buffer->data.u8[offset];
     } else {
-        return buffer->data.f64[offset] * 256.0;
+        return nut_buffer_get_f64(buffer, offset) * NUT_U8_SCALE;
     }
 }
 
 double nut_buffer_get_f64(nut_buffer *buffer, int offset) {
     if (buffer->type == NUT_BUFFER_U8) {
-        return buffer->data.u8[offset] / 256.0;
+        return buffer->data.u8[offset] / NUT_U8_SCALE;
+    } else if (buffer->type == NUT_BUFFER_S16) {
+        return buffer->data.s16[offset] / NUT_S16_SCALE;
+    } else if (buffer->type == NUT_BUFFER_F32 || buffer->type == NUT_BUFFER_CF32) {
+        return buffer->data.f32[offset];
     } else {
         return buffer->data.f64[offset];
     }
@@ -136,38 +329,124 @@ double nut_buffer_get_f64(nut_buffer *buffer, int offset) {
 
 void nut_buffer_set_u8(nut_buffer *buffer, int offset, uint8_t value) {
     if (buffer->type == NUT_BUFFER_U8) {
+        nut_buffer_make_writable(buffer);
         buffer->data.u8[offset] = value;
     } else {
-        buffer->data.f64[offset] = value / 256.0;
+        nut_buffer_set_f64(buffer, offset, value / NUT_U8_SCALE);
     }
 }
 
 void nut_buffer_set_f64(nut_buffer *buffer, int offset, double value) {
+    nut_buffer_make_writable(buffer);
     if (buffer->type == NUT_BUFFER_U8) {
-        buffer->data.u8[offset] = value * 256.0;
+        buffer->data.u8[offset] = value * NUT_U8_SCALE;
+    } else if (buffer->type == NUT_BUFFER_S16) {
+        buffer->data.s16[offset] = _nut_to_s16(value);
+    } else if (buffer->type == NUT_BUFFER_F32 || buffer->type == NUT_BUFFER_CF32) {
+        buffer->data.f32[offset] = value;
     } else {
         buffer->data.f64[offset] = value;
     }
 }
 
+// Bulk accessors. These read count values starting at offset, converted to
+// the output type. Each inner loop handles one type, so the compiler can
+// vectorize it.
+
+void nut_buffer_read_f32(nut_buffer *buffer, int offset, int count, float *restrict out) {
+    assert(offset >= 0 && offset + count <= buffer->length * buffer->channels);
+    if (buffer->type == NUT_BUFFER_U8) {
+        const uint8_t *restrict in = buffer->data.u8 + offset;
+        for (int i = 0; i < count; i++) {
+            out[i] = in[i] * (float) (1.0 / NUT_U8_SCALE);
+        }
+    } else if (buffer->type == NUT_BUFFER_S16) {
+        const int16_t *restrict in = buffer->data.s16 + offset;
+        for (int i = 0; i < count; i++) {
+            out[i] = in[i] * (float) (1.0 / NUT_S16_SCALE);
+        }
+    } else if (buffer->type == NUT_BUFFER_F32 || buffer->type == NUT_BUFFER_CF32) {
+        memcpy(out, buffer->data.f32 + offset, count * sizeof(float));
+    } else {
+        const double *restrict in = buffer->data.f64 + offset;
+        for (int i = 0; i < count; i++) {
+            out[i] = in[i];
+        }
+    }
+}
+
+void nut_buffer_read_f64(nut_buffer *buffer, int offset, int count, double *restrict out) {
+    assert(offset >= 0 && offset + count <= buffer->length * buffer->channels);
+    if (buffer->type == NUT_BUFFER_U8) {
+        const uint8_t *restrict in = buffer->data.u8 + offset;
+        for (int i = 0; i < count; i++) {
+            out[i] = in[i] * (1.0 / NUT_U8_SCALE);
+        }
+    } else if (buffer->type == NUT_BUFFER_S16) {
+        const int16_t *restrict in = buffer->data.s16 + offset;
+        for (int i = 0; i < count; i++) {
+            out[i] = in[i] * (1.0 / NUT_S16_SCALE);
+        }
+    } else if (buffer->type == NUT_BUFFER_F32 || buffer->type == NUT_BUFFER_CF32) {
+        const float *restrict in = buffer->data.f32 + offset;
+        for (int i = 0; i < count; i++) {
+            out[i] = in[i];
+        }
+    } else {
+        memcpy(out, buffer->data.f64 + offset, count * sizeof(double));
+    }
+}
+
+static void _nut_buffer_read_u8(nut_buffer *buffer, int count, uint8_t *restrict out) {
+    if (buffer->type == NUT_BUFFER_U8) {
+        memcpy(out, buffer->data.u8, count);
+    } else if (buffer->type == NUT_BUFFER_S16) {
+        const int16_t *restrict in = buffer->data.s16;
+        for (int i = 0; i < count; i++) {
+            out[i] = in[i] >> 7;
+        }
+    } else if (buffer->type == NUT_BUFFER_F32 || buffer->type == NUT_BUFFER_CF32) {
+        const float *restrict in = buffer->data.f32;
+        for (int i = 0; i < count; i++) {
+            out[i] = in[i] * (float) NUT_U8_SCALE;
+        }
+    } else {
+        const double *restrict in = buffer->data.f64;
+        for (int i = 0; i < count; i++) {
+            out[i] = in[i] * NUT_U8_SCALE;
+        }
+    }
+}
+
+static void _nut_buffer_read_s16(nut_buffer *buffer, int count, int16_t *restrict out) {
+    if (buffer->type == NUT_BUFFER_U8) {
+        const uint8_t *restrict in = buffer->data.u8;
+        for (int i = 0; i < count; i++) {
+            out[i] = in[i] << 7;
+        }
+    } else if (buffer->type == NUT_BUFFER_S16) {
+        memcpy(out, buffer->data.s16, count * sizeof(int16_t));
+    } else {
+        for (int i = 0; i < count; i++) {
+            out[i] = _nut_to_s16(nut_buffer_get_f64(buffer, i));
+        }
+    }
+}
+
 nut_buffer *nut_buffer_convert(nut_buffer *buffer, nut_buffer_type new_type) {
     assert(buffer != NULL);
     int size = buffer->length * buffer->channels;
+    nut_buffer *out = nut_buffer_new(new_type, buffer->length, buffer->channels, NULL);
     if (new_type == NUT_BUFFER_U8) {
-        nut_buffer *out = nut_buffer_new_u8(buffer->length, buffer->channels, NULL);
-        uint8_t *out_data = out->data.u8;
-        for (int i = 0; i < size; i++) {
-            out_data[i] = nut_buffer_get_u8(buffer, i);
-        }
-        return out;
+        _nut_buffer_read_u8(buffer, size, out->data.u8);
+    } else if (new_type == NUT_BUFFER_S16) {
+        _nut_buffer_read_s16(buffer, size, out->data.s16);
+    } else if (new_type == NUT_BUFFER_F32 || new_type == NUT_BUFFER_CF32) {
+        nut_buffer_read_f32(buffer, 0, size, out->data.f32);
     } else {
-        nut_buffer *out = nut_buffer_new_f64(buffer->length, buffer->channels, NULL);
-        double *out_data = out->data.f64;
-        for (int i = 0; i < size; i++) {
-            out_data[i] = nut_buffer_get_f64(buffer, i);
-        }
-        return out;
+        nut_buffer_read_f64(buffer, 0, size, out->data.f64);
     }
+    return out;
 }
 
 void nut_buffer_save(nut_buffer *buffer, const char *fname) {
@@ -180,11 +459,8 @@ void nut_buffer_save(nut_buffer *buffer, const char *fname) {
     }
 }
 
-void nut_buffer_free(nut_buffer *buffer) {
-    if (buffer->type == NUT_BUFFER_U8) {
-        free(buffer->data.u8);
-    } else {
-        free(buffer->data.f64);
-    }
-    free(buffer);
+// Release the buffer. The data is freed once no other buffer shares it.
+void nut_buffer_release(nut_buffer *buffer) {
+    nut_buffer_store_release(buffer->store);
+    _nut_pool_free(buffer, sizeof(nut_buffer));
 }
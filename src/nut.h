@@ -8,40 +8,100 @@
 // Sleep
 
 void nut_sleep_milliseconds(int millis);
+void nut_sleep_seconds(double seconds);
+
+// Time
+
+double nut_time_seconds();
+
+// Atomics
+// Loads/stores used to hand data between threads without locking.
+
+#define NUT_ATOMIC_LOAD(ptr) __atomic_load_n(ptr, __ATOMIC_ACQUIRE)
+#define NUT_ATOMIC_LOAD_RELAXED(ptr) __atomic_load_n(ptr, __ATOMIC_RELAXED)
+#define NUT_ATOMIC_STORE(ptr, value) __atomic_store_n(ptr, value, __ATOMIC_RELEASE)
+#define NUT_ATOMIC_STORE_RELAXED(ptr, value) __atomic_store_n(ptr, value, __ATOMIC_RELAXED)
+#define NUT_ATOMIC_ADD(ptr, value) __atomic_add_fetch(ptr, value, __ATOMIC_SEQ_CST)
+#define NUT_ATOMIC_COMPARE_EXCHANGE(ptr, expected, desired) __atomic_compare_exchange_n(ptr, expected, desired, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)
+#define NUT_ATOMIC_FENCE_ACQUIRE() __atomic_thread_fence(__ATOMIC_ACQUIRE)
+#define NUT_ATOMIC_FENCE_RELEASE() __atomic_thread_fence(__ATOMIC_RELEASE)
+#define NUT_ATOMIC_FENCE() __atomic_thread_fence(__ATOMIC_SEQ_CST)
 
 // Buffer
 
 typedef enum {
     NUT_BUFFER_U8 = 1,
-    NUT_BUFFER_F64
+    NUT_BUFFER_F64,
+    NUT_BUFFER_F32,
+    NUT_BUFFER_CF32,
+    NUT_BUFFER_S16
 } nut_buffer_type;
 
+// CF32 is interleaved complex float. It is stored like F32, with the I and
+// Q values as separate channels.
 typedef union nut_buffer_data {
     uint8_t *u8;
+    int16_t *s16;
+    float *f32;
     double *f64;
 } nut_buffer_data;
 
+// Buffer memory comes from a pool with a free list per power-of-two size
+// class, so buffers of the same size are recycled without malloc/free.
+typedef struct {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t bytes_live;
+    uint64_t bytes_pooled;
+} nut_buffer_pool_stats;
+
+// The memory behind one or more buffers. Buffers are views into a store;
+// the store is freed when the last buffer that refers to it is released.
+typedef struct {
+    int refcount;
+    int size_bytes;
+    uint8_t *data;
+} nut_buffer_store;
+
 typedef struct {
     nut_buffer_type type;
     int length;
     int channels;
     int size_bytes;
     nut_buffer_data data;
+    nut_buffer_store *store;
 } nut_buffer;
 
+nut_buffer_pool_stats nut_buffer_get_pool_stats();
+void nut_buffer_pool_trim();
+
+nut_buffer_store *nut_buffer_store_new(int size_bytes);
+void nut_buffer_store_retain(nut_buffer_store *store);
+void nut_buffer_store_release(nut_buffer_store *store);
+
+nut_buffer *nut_buffer_new(nut_buffer_type type, int length, int channels, const void *data);
 nut_buffer *nut_buffer_new_u8(int length, int channels, const uint8_t *data);
+nut_buffer *nut_buffer_new_s16(int length, int channels, const int16_t *data);
+nut_buffer *nut_buffer_new_f32(int length, int channels, const float *data);
+nut_buffer *nut_buffer_new_cf32(int length, int channels, const float *data);
 nut_buffer *nut_buffer_new_f64(int length, int channels, const double *data);
+nut_buffer *nut_buffer_new_with_store(nut_buffer_type type, int length, int channels, nut_buffer_store *store);
+nut_buffer *nut_buffer_new_view(nut_buffer *buffer, int offset, int length);
 nut_buffer *nut_buffer_copy(nut_buffer *buffer);
 nut_buffer *nut_buffer_reduce(nut_buffer *buffer, double percentage);
 nut_buffer *nut_buffer_clip(nut_buffer *buffer, int offset, int length);
+int nut_buffer_is_writable(nut_buffer *buffer);
+void nut_buffer_make_writable(nut_buffer *buffer);
 void nut_buffer_set_data(nut_buffer *dst, nut_buffer *src);
 void nut_buffer_append(nut_buffer *dst, nut_buffer *src);
 uint8_t nut_buffer_get_u8(nut_buffer *buffer, int offset);
 double nut_buffer_get_f64(nut_buffer *buffer, int offset);
 void nut_buffer_set_u8(nut_buffer *buffer, int offset, uint8_t value);
 void nut_buffer_set_f64(nut_buffer *buffer, int offset, double value);
+void nut_buffer_read_f32(nut_buffer *buffer, int offset, int count, float *out);
+void nut_buffer_read_f64(nut_buffer *buffer, int offset, int count, double *out);
 nut_buffer *nut_buffer_convert(nut_buffer *buffer, nut_buffer_type new_type);
 void nut_buffer_save(nut_buffer *buffer, const char *fname);
-void nut_buffer_free(nut_buffer *buffer);
+void nut_buffer_release(nut_buffer *buffer);
 
 #endif // NUT_H